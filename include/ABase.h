@@ -8,14 +8,14 @@
 #include <utility>
 
 // prefer to use linux syscall (system thread id)
-#ifdef linux  // linux platform
+#ifdef __linux__  // linux platform
 #include <sys/syscall.h>
 #include <unistd.h>
 #define gettid() syscall(SYS_gettid)
 #else  // use std::thread::id
 std::hash<std::thread::id> ThreadIDHasher;
 #define gettid() ThreadIDHasher(std::this_thread::get_id())
-#endif  // linux platform
+#endif  // __linux__
 
 #define LOG(fmt, x...)                                                                           \
     {                                                                                            \
@@ -0,0 +1,93 @@
+#ifndef __A_CLOCK_H__
+#define __A_CLOCK_H__
+
+#include "ABase.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace diordna {
+
+struct ALooper;
+
+// time source of a looper. loopers without a clock follow ALooper::GetNowUs (steady_clock)
+struct AClock {
+    AClock() {}
+
+    virtual int64_t nowUs() = 0;
+
+    // a manual clock only moves when told to. loopers using it never sleep on a timeout but
+    // report when they are idle, and wait until the clock wakes them up.
+    virtual bool isManual() const { return false; }
+
+    virtual ~AClock() {}
+
+private:
+    friend struct ALooper;  // attach/detach, onBusy/onIdle
+
+    // START --- methods used only by ALooper, with the looper lock held
+
+    virtual void attach(const std::shared_ptr<ALooper> &looper, bool busy, int64_t deadlineUs) {}
+    virtual void detach(const ALooper *looper) {}
+
+    // the looper has work to do
+    virtual void onBusy(const ALooper *looper) {}
+    // the looper has nothing to do before |deadlineUs|. returns the loopers which must be woken
+    // up as their deadline has been reached, possibly including the calling one.
+    virtual std::vector<std::shared_ptr<ALooper>> onIdle(const ALooper *looper,
+                                                         int64_t deadlineUs) {
+        return {};
+    }
+
+    // END --- methods used only by ALooper
+
+    DECLARE_NON_COPYASSIGNABLE(AClock);
+};
+
+// A manually advanced clock, which can be shared by several loopers. With auto advance enabled,
+// whenever every attached looper is idle time jumps to the earliest pending deadline, so delayed
+// messages fire immediately and in deadline order. A looper thread blocked in a synchronous call,
+// postAndAwaitResponse() or postAndWait(), counts as idle until it returns. Posts from threads
+// which are not looper threads race with auto advance, disable it while setting up a
+// deterministic scenario.
+struct AVirtualClock : public AClock {
+    explicit AVirtualClock(int64_t startUs = 0, bool autoAdvance = true);
+
+    int64_t nowUs() override;
+    bool isManual() const override { return true; }
+
+    // move time forward by |deltaUs| and wake up every attached looper
+    void advanceUs(int64_t deltaUs);
+
+    void setAutoAdvance(bool autoAdvance);
+
+private:
+    struct LooperState {
+        std::weak_ptr<ALooper> mLooper;
+        bool mBusy;
+        int64_t mDeadlineUs;
+    };
+
+    std::mutex mLock;
+    int64_t mNowUs;
+    bool mAutoAdvance;
+    std::unordered_map<const ALooper *, LooperState> mLoopers;
+
+    void attach(const std::shared_ptr<ALooper> &looper, bool busy, int64_t deadlineUs) override;
+    void detach(const ALooper *looper) override;
+    void onBusy(const ALooper *looper) override;
+    std::vector<std::shared_ptr<ALooper>> onIdle(const ALooper *looper,
+                                                 int64_t deadlineUs) override;
+
+    // jump to the earliest deadline if every looper is idle, and collect the loopers to wake up
+    void advanceIfIdleLocked(std::vector<std::shared_ptr<ALooper>> *loopers);
+
+    DECLARE_NON_COPYASSIGNABLE(AVirtualClock);
+};
+
+}  // namespace diordna
+
+#endif  // __A_CLOCK_H__
\ No newline at end of file
@@ -4,46 +4,81 @@
 #include "ABase.h"
 #include "ALooper.h"
 
+#include <atomic>
 #include <cstdint>
 #include <memory>
+#include <mutex>
 
 namespace diordna {
 
 struct AMessage;
 
 struct AHandler : public std::enable_shared_from_this<AHandler> {
-    AHandler() : mId(0), mVerboseStats(false), mMessageCounter(0) {}
+    AHandler()
+        : mId(0), mVerboseStats(false), mMessageCounter(0), mExpiredCounter(0), mBusyUs(0) {}
 
     ALooper::handler_id id() const { return mId; }
 
-    std::shared_ptr<ALooper> looper() const { return mLooper.lock(); }
+    // the looper may change, see ALooper::migrateHandler
+    std::shared_ptr<ALooper> looper() const {
+        std::lock_guard<std::mutex> _lock(mLooperLock);
+        return mLooper.lock();
+    }
 
-    std::weak_ptr<ALooper> getLooper() const { return mLooper; }
+    std::weak_ptr<ALooper> getLooper() const {
+        std::lock_guard<std::mutex> _lock(mLooperLock);
+        return mLooper;
+    }
 
     std::weak_ptr<AHandler> getHandler() const {
         return std::const_pointer_cast<AHandler>(shared_from_this());
     }
 
+    // messages delivered to onMessageReceived
+    uint32_t messageCount() const { return mMessageCounter.load(std::memory_order_relaxed); }
+
+    // messages dropped without delivery as their expiry deadline had passed
+    uint32_t expiredCount() const { return mExpiredCounter.load(std::memory_order_relaxed); }
+
+    // total time spent in onMessageReceived, nested synchronous calls included
+    int64_t busyUs() const { return mBusyUs.load(std::memory_order_relaxed); }
+
 protected:
     virtual void onMessageReceived(const std::shared_ptr<AMessage> &msg) = 0;
 
+    // called instead of onMessageReceived for a message whose expiry deadline has passed
+    virtual void onMessageExpired(const std::shared_ptr<AMessage> &msg) {}
+
 private:
     friend struct AMessage;       // deliverMessage()
+    friend struct ALooper;        // deliverMessage(), expireMessage(), setLooper(), mBusyUs
+    friend struct APipeline;      // deliverMessage()
     friend struct ALooperRoster;  // setID()
 
     ALooper::handler_id mId;
+    mutable std::mutex mLooperLock;
     std::weak_ptr<ALooper> mLooper;
 
     inline void setID(ALooper::handler_id id, const std::weak_ptr<ALooper> &looper) {
         mId = id;
+        setLooper(looper);
+    }
+
+    inline void setLooper(const std::weak_ptr<ALooper> &looper) {
+        std::lock_guard<std::mutex> _lock(mLooperLock);
         mLooper = looper;
     }
 
     bool mVerboseStats;
-    uint32_t mMessageCounter;
+    std::atomic<uint32_t> mMessageCounter;
     KeyedVector<uint32_t, uint32_t> mMessages;
 
+    std::atomic<uint32_t> mExpiredCounter;
+    // only written by the thread of the current looper
+    std::atomic<int64_t> mBusyUs;
+
     void deliverMessage(const std::shared_ptr<AMessage> &msg);
+    void expireMessage(const std::shared_ptr<AMessage> &msg);
 
     DECLARE_NON_COPYASSIGNABLE(AHandler);
 };
@@ -2,18 +2,25 @@
 #define __A_LOOPER_H__
 
 #include "ABase.h"
+#include "ATask.h"
 
+#include <atomic>
 #include <condition_variable>
 #include <cstdint>
+#include <functional>
 #include <list>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_set>
+#include <vector>
 
 namespace diordna {
 
+struct AClock;
 struct AHandler;
 struct AMessage;
+struct ARecorder;
 struct AReplyToken;
 
 struct ALooper : public std::enable_shared_from_this<ALooper> {
@@ -24,25 +31,186 @@ struct ALooper : public std::enable_shared_from_this<ALooper> {
 
     void setName(const char *name);
 
-    handler_id registerHandler(const std::shared_ptr<AHandler> &handler);
+    // With |retain|, the looper also keeps |handler| alive until it is unregistered, and delivers
+    // to it without taking a reference each time. It can then be posted to with postDirect().
+    handler_id registerHandler(const std::shared_ptr<AHandler> &handler, bool retain = false);
     void unregisterHandler(handler_id handlerID);
 
     status_t start(bool runOnCallingThread = false);
     status_t stop();
 
+    struct BatchEntry {
+        std::shared_ptr<AMessage> mMessage;
+        int64_t mDelayUs;
+    };
+
+    // post |count| messages, all targeting handlers of this looper, merging them into the queue
+    // under a single lock with at most one wakeup. entries with the same due time keep their
+    // order. nothing is posted and BAD_VALUE is returned if any message targets another looper.
+    status_t postBatch(const BatchEntry *entries, std::size_t count);
+    status_t postBatch(const std::vector<BatchEntry> &entries) {
+        return postBatch(entries.data(), entries.size());
+    }
+
+    // Fast path to a handler registered with |retain|: queue |msg| for |handlerId|, taking over
+    // the reference of the caller. Unlike AMessage::post(), no reference is taken on the looper,
+    // the handler or the message, releasing the message after delivery is the only atomic
+    // operation left. |msg| needs no target, build it with the default constructor and
+    // setWhat() to also skip the references a target costs. It can then only be posted again
+    // with postDirect(), nor can it await a response. returns NAME_NOT_FOUND if |handlerId| is
+    // not retained by this looper.
+    status_t postDirect(std::shared_ptr<AMessage> &&msg, handler_id handlerId,
+                        int64_t delayUs = 0);
+
+    // Move |handler| from this looper to |target|, while this looper is between deliveries. The
+    // queued messages of the handler move along in order, messages still posted here for it are
+    // forwarded, and the fds it watches here are watched by |target| instead. Tasks, broadcasts
+    // queued before the move and barriers stay, so messages moved ahead of a barrier are no
+    // longer held back by it. The handler keeps its id. Handlers of an APipeline stage must not
+    // be moved.
+    // Called from another thread, this waits for the move. Called on this looper's thread, e.g.
+    // by a handler moving itself from onMessageReceived(), the move is queued to happen once the
+    // current delivery returns, and OK only means it was queued.
+    status_t migrateHandler(const std::shared_ptr<AHandler> &handler,
+                            const std::shared_ptr<ALooper> &target);
+
+    // run |task| on the looper thread after |delayUs|, ordered with the messages posted to it
+    status_t post(ATask &&task, int64_t delayUs = 0);
+
+    // run |task| on the looper thread and block until it completed. runs it inline when called
+    // from the looper thread itself. returns NAME_NOT_FOUND, with |task| dropped without running,
+    // if the looper is not running or stops before getting to it.
+    status_t postAndWait(ATask &&task);
+
+    enum PeriodicPolicy {
+        // every missed tick is delivered, back to back, so the number of ticks stays right
+        PERIODIC_CATCH_UP,
+        // missed ticks are dropped, the next one is the first still ahead on the original grid
+        PERIODIC_SKIP,
+    };
+
+    // Deliver |msg|, which must target a handler of this looper, first after |delayUs| then every
+    // |periodUs|. Ticks are scheduled against absolute deadlines (first + n * period), so the
+    // time taken by the handler does not accumulate as drift, and the same instance is delivered
+    // each time without allocating. returns the token to cancel it with, or BAD_VALUE. a
+    // periodic message stays on this looper when its handler migrates, and is forwarded on
+    // every tick.
+    int32_t postPeriodic(const std::shared_ptr<AMessage> &msg, int64_t periodUs,
+                         PeriodicPolicy policy = PERIODIC_SKIP, int64_t delayUs = 0);
+    // no tick is delivered once it returns, unless called during the delivery of one
+    status_t cancelPeriodic(int32_t token);
+
+    // Post a synchronization barrier. Events queued before it are delivered as usual, but once it
+    // reaches the head of the queue only asynchronous messages (see AMessage::setAsynchronous)
+    // are delivered, until the barrier is removed and the others are released in order.
+    // returns the token identifying the barrier.
+    int32_t postSyncBarrier();
+    status_t removeSyncBarrier(int32_t token);
+
+    // Fair scheduling. Instead of strictly in due order, the events which are due are served per
+    // handler by deficit round-robin: each handler with due messages gets turns worth |quantumUs|
+    // times its weight of delivery time, so a handler flooding the looper delays the others by
+    // about one turn at most. Tasks and broadcasts take turns together, as one more handler. The
+    // messages of one handler stay in order, and barriers still hold back messages.
+    void setFairScheduling(bool enabled, int64_t quantumUs = 1000);
+    // the share of a handler under fair scheduling, 1 by default
+    status_t setHandlerWeight(handler_id handlerId, uint32_t weight);
+
+    using IdleHandler = std::function<bool()>;
+
+    // |handler| runs on the looper thread when the looper is about to block because nothing is
+    // due, once per idle period. It stays registered for as long as it returns true.
+    int32_t addIdleHandler(const IdleHandler &handler);
+    status_t removeIdleHandler(int32_t id);
+
     static int64_t GetNowUs();
 
+    // Use |clock| as the time base of this looper, nullptr restores GetNowUs. Loopers sharing an
+    // AVirtualClock run in virtual time, see AClock.h.
+    void setClock(const std::shared_ptr<AClock> &clock);
+
+    // current time in the time base of this looper
+    int64_t nowUs();
+
     const char *getName() const { return mName.c_str(); }
 
+    // Delayed events becoming due within |slackUs| of the head event are delivered together in
+    // a single wakeup. An event may be delivered up to |slackUs| late, but never early.
+    void setTimerSlackUs(int64_t slackUs);
+
+    struct Stats {
+        uint64_t mWakeups;       // returns from a blocking wait, for whatever reason
+        uint64_t mTimedWakeups;  // wakeups caused by a delayed event becoming due
+        uint64_t mDelivered;     // events taken off the queue and delivered
+        uint64_t mExpired;       // messages taken off the queue past their expiry deadline
+        int64_t mBusyUs;         // time spent delivering events and running idle handlers
+
+        // queued events and their approximate memory footprint, with their high-water marks
+        std::size_t mQueueDepth;
+        std::size_t mMaxQueueDepth;
+        std::size_t mQueueBytes;
+        std::size_t mMaxQueueBytes;
+    };
+
+    Stats getStats();
+
+    struct Delivery {
+        handler_id mHandlerId;  // 0 for tasks
+        uint32_t mWhat;
+        int64_t mStartUs;  // GetNowUs() when it started, 0 if nothing is being delivered
+        uint64_t mSeq;     // distinguishes successive deliveries
+    };
+
+    // the delivery in progress on the looper thread, safe to sample from any thread
+    Delivery getCurrentDelivery() const;
+
+    void dump(int fd);
+
+    // log every message posted to this looper to |recorder|, nullptr stops. see ARecorder.h
+    void setRecorder(const std::shared_ptr<ARecorder> &recorder);
+
+    enum {
+        EVENT_INPUT = 1 << 0,
+        EVENT_OUTPUT = 1 << 1,
+        EVENT_ERROR = 1 << 2,
+        EVENT_HANGUP = 1 << 3,
+    };
+
+    // Watch |fd| for |events| (a mask of EVENT_INPUT/EVENT_OUTPUT). Whenever it is ready, a
+    // message |what| carrying int32 "fd" and "events" is delivered to |handler| on this looper's
+    // thread. EVENT_ERROR and EVENT_HANGUP are always reported. The first call switches the
+    // looper from its condition variable to epoll, timers are then driven by the epoll timeout.
+    // A busy looper also polls its fds every few deliveries. A ready fd is reported again only
+    // once its previous message has been delivered.
+    // Adding an fd that is already watched replaces its previous registration.
+    status_t addFd(int fd, int events, const std::shared_ptr<AHandler> &handler, uint32_t what);
+    status_t removeFd(int fd);
+
     virtual ~ALooper();
 
 private:
     friend struct AMessage;  // post
     friend struct LooperThread; // loop
+    friend struct AVirtualClock;  // wake
+    friend struct ATopic;         // postBroadcast
+    friend struct APipeline;      // beginDelivery
+
+    using HandlerList = std::vector<std::weak_ptr<AHandler>>;
 
     struct Event {
         int64_t mWhenUs;
         std::shared_ptr<AMessage> mMessage;
+        ATask mTask;  // run instead of delivering a message
+        // broadcast, the message is delivered to each of them instead of its own target
+        std::shared_ptr<const HandlerList> mHandlers;
+        int32_t mBarrierToken;  // non zero for synchronization barriers
+        int32_t mPeriodicToken;  // non zero for periodic messages
+        int64_t mPeriodUs;
+        bool mCatchUp;
+        uint32_t mFdSeq;  // non zero for fd events, the sequence of the request of mFd
+        int mFd;
+        // the completion of a postAndWait() task, to take it back if the wait fails
+        const void *mCompletion;
     };
 
     std::mutex mLock;
@@ -52,9 +220,89 @@ private:
 
     std::list<Event> mEventQueue;
 
+    std::shared_ptr<AClock> mClock;
+    int64_t mTimerSlackUs;
+    std::shared_ptr<ARecorder> mRecorder;
+    Stats mStats;
+
+    // written by the looper thread around each delivery, sampled by watchdogs without the lock
+    std::atomic<uint64_t> mDeliverySeq;
+    std::atomic<handler_id> mDeliveryHandlerId;
+    std::atomic<uint32_t> mDeliveryWhat;
+    std::atomic<int64_t> mDeliveryStartUs;
+    // only written by the looper thread
+    std::atomic<int64_t> mBusyUs;
+
+    // handlers which migrated away, and the looper they went to
+    KeyedVector<handler_id, std::weak_ptr<ALooper>> mMigrated;
+
+    // handlers registered with |retain|, only ever released by the looper thread in between two
+    // deliveries, so that it can deliver to them through a plain pointer
+    KeyedVector<handler_id, std::shared_ptr<AHandler>> mRetained;
+
+    // fair scheduling. due events are moved from mEventQueue to the ready queue of their handler,
+    // or of handler 0 for tasks and broadcasts, and mFairRound lists the non-empty ready queues
+    // in service order. the front one is being served.
+    struct FairQueue {
+        std::list<Event> mEvents;
+        int64_t mDeficitUs;
+    };
+
+    bool mFairScheduling;
+    int64_t mFairQuantumUs;
+    KeyedVector<handler_id, uint32_t> mFairWeights;
+    KeyedVector<handler_id, FairQueue> mFairQueues;
+    std::list<handler_id> mFairRound;
+    // the front of mFairRound got its quantum for the current turn
+    bool mFairTurnStarted;
+    // the last delivery from a ready queue, charged on the next loop. looper thread only
+    handler_id mFairChargeKey;
+    int64_t mFairChargeUs;
+    bool mFairChargePending;
+
+    int32_t mNextBarrierToken;
+
+    int32_t mNextPeriodicToken;
+    // periodic messages not cancelled yet
+    std::unordered_set<int32_t> mPeriodicTokens;
+
+    struct IdleEntry {
+        int32_t mId;
+        std::shared_ptr<IdleHandler> mHandler;
+    };
+
+    std::vector<IdleEntry> mIdleHandlers;
+    int32_t mNextIdleHandlerId;
+    // idle handlers already ran since the last delivery
+    bool mIdleHandlersRan;
+    // snapshot of mIdleHandlers run by the looper thread without the lock, reused
+    std::vector<IdleEntry> mPendingIdleHandlers;
+
+    // epoll mode, only valid once mEpollFd >= 0
+    struct FdRequest {
+        uint32_t mSeq;  // guards against a stale readiness report for a re-added fd
+        int mEvents;
+        uint32_t mWhat;
+        std::weak_ptr<AHandler> mHandler;
+        // its event is queued and not delivered yet, the fd is still ready until then
+        bool mPending;
+    };
+
+    int mEpollFd;
+    int mWakeFd;
+    uint32_t mNextFdSeq;
+    KeyedVector<int, FdRequest> mFdRequests;
+    // a looper which always has something due polls its fds in between deliveries
+    static constexpr uint32_t kDeliveriesPerFdPoll = 8;
+    uint32_t mDeliveriesSinceFdPoll;
+
     struct LooperThread;
+    // the calling looper thread, if any, blocks in a synchronous call for its lifetime
+    struct BlockedCall;
     std::shared_ptr<LooperThread> mThread;
     bool mRunningLocally;
+    // stop() was called since the last start(), the loop is expected to find no thread
+    bool mStopped;
 
     // use a separate lock for reply handling, as it is always on another thread
     // use a central lock, however, to avoid creating a mutex for each reply
@@ -63,8 +311,8 @@ private:
 
     // START --- methods used only by AMessage
 
-    // post a message on this looper with the given timeout
-    void post(const std::shared_ptr<AMessage> &msg, int64_t delayUs);
+    // post a message on this looper with the given timeout. |msg| is moved into the queue
+    void post(std::shared_ptr<AMessage> msg, int64_t delayUs);
 
     // create a reply token to be used with this looper
     std::shared_ptr<AReplyToken> createReplyToken();
@@ -72,6 +320,11 @@ private:
     // is stored into the supplied variable. Otherwise, it is changed.
     status_t awaitResponse(const std::shared_ptr<AReplyToken> &replyToken,
                            std::shared_ptr<AMessage> *response);
+    // delivers |msg| inline, called from the looper thread itself, and takes the reply it got
+    // synchronously. returns WOULD_BLOCK if the handler did not reply before returning.
+    status_t deliverAndTakeResponse(const std::shared_ptr<AMessage> &msg,
+                                    const std::shared_ptr<AReplyToken> &replyToken,
+                                    std::shared_ptr<AMessage> *response);
     // posts a reply for a reply token. If the reply could be successfully posted,
     // it returns OK. Otherwise, it returns an error value.
     status_t postReply(const std::shared_ptr<AReplyToken> &replyToken,
@@ -81,6 +334,97 @@ private:
 
     bool loop();
 
+    // post |msg| once on this looper, to be delivered to each of |handlers|
+    void postBroadcast(const std::shared_ptr<AMessage> &msg, int64_t delayUs,
+                       const std::shared_ptr<const HandlerList> &handlers);
+
+    int64_t whenUsLocked(int64_t delayUs);
+    void enqueueLocked(Event &&event);
+    // moves the single event of |node| into the queue, without allocating
+    void enqueueLocked(std::list<Event> *node);
+    // the head of the queue changed, the looper must re-evaluate when to wake up
+    void headChangedLocked();
+
+    // the next event to deliver in due order, past the barrier at the head of the queue if any
+    std::list<Event>::iterator nextEventLocked();
+
+    static handler_id FairKey(const Event &event);
+    // move |it| from mEventQueue to its ready queue
+    void promoteLocked(std::list<Event>::iterator it);
+    // charge the last delivery from a ready queue, ending the turn if it is over
+    void chargeLocked();
+    // moves the next event of the handler being served into |into|
+    void takeFairLocked(std::list<Event> *into);
+    // forget the ready queue |it|, which is empty or whose events are gone with their handler
+    void dropFairQueueLocked(KeyedVector<handler_id, FairQueue>::iterator it);
+
+    // erase the first queued event matching |predicate|, ready ones included. returns false if
+    // there is none, e.g. as it is being delivered
+    template <typename Predicate>
+    bool eraseEventLocked(Predicate predicate);
+
+    // schedule the next tick of the periodic message just delivered, the single event of
+    // |current|, unless it has been cancelled
+    void reschedulePeriodic(std::list<Event> *current);
+
+    static bool IsAsynchronous(const Event &event);
+    // |event| may go through the barrier at the head of the queue
+    bool isReleasedByBarrierLocked(const Event &event) const;
+
+    static std::size_t EventBytes(const Event &event);
+    void accountEnqueuedLocked(const Event &event);
+    void accountDequeuedLocked(const Event &event);
+
+    // run the idle handlers if they have not run yet in this idle period. returns true if they
+    // did, in which case the lock has been dropped meanwhile.
+    bool runIdleHandlersLocked(std::unique_lock<std::mutex> &lock);
+
+    // drop a message past its expiry deadline, notifying its handlers and any waiting sender
+    // |retained| is the handler of the message, if retained
+    void expire(const Event &event, AHandler *retained = nullptr);
+
+    // hands the reference on a retained handler over to the looper thread
+    void releaseRetained(handler_id handlerId);
+
+    // single writer seqlock, the sequence is odd while the fields are updated
+    void publishDelivery(handler_id handlerId, uint32_t what, int64_t startUs);
+    void beginDelivery(handler_id handlerId, uint32_t what);
+    // accounts the delivery time to |handler|, if any, and to the looper
+    // returns the delivery time
+    int64_t endDelivery(AHandler *handler);
+    // report |delivery| again once a delivery to |handler| nested in it is done
+    // returns the time of the nested delivery
+    int64_t resumeDelivery(const Delivery &delivery, AHandler *handler);
+
+    // the looper |handlerId| migrated to, if it did
+    std::shared_ptr<ALooper> migratedToLocked(handler_id handlerId);
+    // the migration itself, from the looper thread or while it is stopped
+    status_t moveHandler(const std::shared_ptr<AHandler> &handler,
+                         const std::shared_ptr<ALooper> &target);
+
+    // block on the queue condition, or on epoll, for at most |timeoutUs|, or until woken up if it
+    // is negative. returns true if the wait timed out.
+    bool waitLocked(std::unique_lock<std::mutex> &lock, int64_t timeoutUs);
+    // wait on epoll for at most |timeoutMs|, or until woken up if it is negative, then queue the
+    // messages of the ready fds. returns the number of epoll events.
+    int pollFdsLocked(std::unique_lock<std::mutex> &lock, int timeoutMs);
+    void wakeLocked();
+    void wake();
+
+    int64_t nowUsLocked();
+    bool isCurrentThread() const;
+    bool isRunningLocked() const { return mThread != nullptr || mRunningLocally; }
+    // report to a manual clock that nothing is due before |deadlineUs|. returns true if loopers
+    // had to be woken up as time moved, in which case the lock has been dropped meanwhile.
+    bool reportIdleLocked(std::unique_lock<std::mutex> &lock, int64_t deadlineUs);
+    // a looper thread blocked in a synchronous call delivers nothing until it returns, a manual
+    // clock counts it as idle meanwhile so that time can reach what the call waits for
+    void setBlocked(bool blocked);
+
+    status_t enableFdEventsLocked();
+    status_t addFdLocked(int fd, int events, const std::shared_ptr<AHandler> &handler,
+                         uint32_t what);
+
     DECLARE_NON_COPYASSIGNABLE(ALooper);
 };
 
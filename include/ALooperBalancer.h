@@ -0,0 +1,76 @@
+#ifndef __A_LOOPER_BALANCER_H__
+#define __A_LOOPER_BALANCER_H__
+
+#include "ABase.h"
+#include "ALooper.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace diordna {
+
+struct AHandler;
+
+// Moves hot handlers off saturated loopers. Every |intervalUs| a background thread compares the
+// time each looper spent delivering (see ALooper::Stats::mBusyUs). When the busiest and the
+// least busy looper are more than |threshold| of the interval apart, the busiest handler of the
+// busiest looper whose own load fits in half that gap is migrated to the least busy one, so the
+// imbalance shrinks without flipping over. At most one handler moves per interval.
+//
+// Only the handlers added are ever moved, and only between the loopers added.
+struct ALooperBalancer {
+    explicit ALooperBalancer(int64_t intervalUs = 1000000, double threshold = 0.25);
+
+    status_t addLooper(const std::shared_ptr<ALooper> &looper);
+    status_t removeLooper(const std::shared_ptr<ALooper> &looper);
+
+    status_t addHandler(const std::shared_ptr<AHandler> &handler);
+    status_t removeHandler(const std::shared_ptr<AHandler> &handler);
+
+    status_t start();
+    status_t stop();
+
+    // handlers migrated so far
+    uint32_t migrationCount();
+
+    virtual ~ALooperBalancer();
+
+private:
+    struct LooperState {
+        std::weak_ptr<ALooper> mLooper;
+        int64_t mLastBusyUs;
+        int64_t mBusyUs;  // over the last interval
+    };
+
+    struct HandlerState {
+        std::weak_ptr<AHandler> mHandler;
+        int64_t mLastBusyUs;
+        int64_t mBusyUs;  // over the last interval
+    };
+
+    std::mutex mLock;
+    std::condition_variable mCondition;
+    int64_t mIntervalUs;
+    double mThreshold;
+    std::vector<LooperState> mLoopers;
+    std::vector<HandlerState> mHandlers;
+    uint32_t mMigrations;
+    std::thread mThread;
+    bool mRunning;
+
+    void threadLoop();
+    // updates the load of every looper and handler over |elapsedUs|, and picks the handler to
+    // move, if any
+    bool sampleLocked(int64_t elapsedUs, std::shared_ptr<AHandler> *handler,
+                      std::shared_ptr<ALooper> *from, std::shared_ptr<ALooper> *to);
+
+    DECLARE_NON_COPYASSIGNABLE(ALooperBalancer);
+};
+
+}  // namespace diordna
+
+#endif  // __A_LOOPER_BALANCER_H__
\ No newline at end of file
@@ -19,6 +19,13 @@ struct ALooperRoster {
     void unregisterHandler(ALooper::handler_id handlerId);
     void unregisterStaleHandlers();
 
+    // record that |handlerId| now runs on |looper|, see ALooper::migrateHandler
+    void moveHandler(ALooper::handler_id handlerId, const std::shared_ptr<ALooper> &looper);
+
+    // the live handler registered as |handlerId|, or nullptr
+    std::shared_ptr<AHandler> findHandler(ALooper::handler_id handlerId);
+
+    // per looper statistics, the delivery in progress, and the handlers registered to it
     void dump(int fd, const std::vector<std::string> &args);
 
 private:
@@ -13,6 +13,9 @@ namespace diordna {
 
 struct AHandler;
 
+template <typename Payload>
+struct ATypedMessage;
+
 struct AReplyToken {
     explicit AReplyToken(const std::shared_ptr<ALooper> &looper)
         : mLooper(looper), mReplied(false) {}
@@ -37,6 +40,25 @@ private:
     status_t setReply(const std::shared_ptr<AMessage> &reply);
 };
 
+// read-only view over a contiguous array item of a message
+template <typename T>
+struct ASpan {
+    ASpan() : mData(nullptr), mSize(0) {}
+    ASpan(const T *data, std::size_t size) : mData(data), mSize(size) {}
+
+    const T *data() const { return mData; }
+    std::size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+
+    const T *begin() const { return mData; }
+    const T *end() const { return mData + mSize; }
+    const T &operator[](std::size_t i) const { return mData[i]; }
+
+private:
+    const T *mData;
+    std::size_t mSize;
+};
+
 struct AMessage : public std::enable_shared_from_this<AMessage> {
     AMessage();
     AMessage(uint32_t what, const std::shared_ptr<const AHandler> &handler);
@@ -47,26 +69,56 @@ struct AMessage : public std::enable_shared_from_this<AMessage> {
     void setTarget(const std::shared_ptr<const AHandler> &handler);
     void clear();
 
+    // asynchronous messages are not held back by the synchronization barriers of a looper
+    void setAsynchronous(bool async);
+    bool isAsynchronous() const;
+
+    // Drop the message instead of delivering it if it is dequeued after |deadlineUs|, in the time
+    // base of the target looper (see ALooper::nowUs). Its handler gets onMessageExpired instead,
+    // and a sender awaiting a response gets a reply with int32 "err" set to TIMED_OUT.
+    // INT64_MAX, the default, never expires.
+    void setExpiryUs(int64_t deadlineUs);
+    int64_t expiryUs() const;
+
     void setInt32(const char *name, int32_t value);
     void setInt64(const char *name, int64_t value);
+    void setSize(const char *name, std::size_t value);
+    void setFloat(const char *name, float value);
+    void setDouble(const char *name, double value);
     void setString(const char *name, const std::string &s);
     void setString(const char *name, const char *s);
     // void setMessage(const char *name, const std::shared_ptr<AMessage> &msg);
     void setObject(const char *name, const std::shared_ptr<void> &obj);  // XXX: tricky?
+
+    // Arrays are copied once into kArrayAlignment aligned storage, ready for vectorized
+    // processing. The storage is immutable and shared by dup(), never copied again.
+    void setInt32Array(const char *name, const int32_t *data, std::size_t count);
+    void setInt64Array(const char *name, const int64_t *data, std::size_t count);
+    void setFloatArray(const char *name, const float *data, std::size_t count);
     // XXX: extendable
 
     bool contains(const char *name) const;
 
     bool findInt32(const char *name, int32_t *value) const;
     bool findInt64(const char *name, int64_t *value) const;
+    bool findSize(const char *name, std::size_t *value) const;
+    bool findFloat(const char *name, float *value) const;
+    bool findDouble(const char *name, double *value) const;
     bool findString(const char *name, std::string *value) const;
     // bool findMessage(const char *name, std::shared_ptr<AMessage> *msg) const;
     bool findObject(const char *name, std::shared_ptr<void> *obj) const;  // XXX
+
+    bool findInt32Array(const char *name, ASpan<int32_t> *span) const;
+    bool findInt64Array(const char *name, ASpan<int64_t> *span) const;
+    bool findFloatArray(const char *name, ASpan<float> *span) const;
     // XXX: extendable
 
     status_t post(int64_t delayUs = 0);
 
-    // block call. post message and wait for response or error
+    // block call. post message and wait for response or error.
+    // Called from the thread of the target looper, the message is delivered inline instead,
+    // ahead of anything queued and reentering the handler if it is the caller. The handler must
+    // then reply before returning, WOULD_BLOCK is returned otherwise.
     status_t postAndAwaitResponse(std::shared_ptr<AMessage> *response);
 
     //  If this returns true, the sender of this message is synchronously awaiting a response and
@@ -79,7 +131,7 @@ struct AMessage : public std::enable_shared_from_this<AMessage> {
     status_t postReply(const std::shared_ptr<AReplyToken> &replyID);
 
     // perform deep-copy of "this"
-    std::shared_ptr<AMessage> dup() const;
+    virtual std::shared_ptr<AMessage> dup() const;
 
     // add all items from "other" into "this"
     void extend(const std::shared_ptr<AMessage> &other);
@@ -100,20 +152,38 @@ struct AMessage : public std::enable_shared_from_this<AMessage> {
         kTypeString,
         kTypeObject,
         // kTypeMessage,
+        kTypeInt32Array,
+        kTypeInt64Array,
+        kTypeFloatArray,
         // XXX: extendable
     };
 
+    // iterate over the items, in the order they were first set
+    std::size_t countEntries() const;
+    const char *getEntryNameAt(std::size_t index, Type *type) const;
+
+    enum { kArrayAlignment = 64 };
+
     // XXX: extendable for more types. or more complicate structure. eg. Buffer/Data
 
     virtual ~AMessage();
 
 private:
-    friend struct ALooper;  // deliver
+    friend struct ALooper;  // mHandler, mLooper, mTarget
+    template <typename Payload>
+    friend struct ATypedMessage;  // mPayloadTag, copyItemsTo()
+
     uint32_t mWhat;
 
+    // identifies the payload type of an ATypedMessage, nullptr for plain messages
+    const void *mPayloadTag;
+
     // debug only
     ALooper::handler_id mTarget;
 
+    bool mAsynchronous;
+    int64_t mExpiryUs;
+
     std::weak_ptr<AHandler> mHandler;
     std::weak_ptr<ALooper> mLooper;
 
@@ -128,7 +198,8 @@ private:
             const char *stringValue;
             // XXX: extendable
         } u;
-        std::shared_ptr<void> mObj = nullptr; // FIXME: workaround for set/findObject
+        // owns objects, strings and arrays. immutable, so copies of the item share it
+        std::shared_ptr<void> mObj = nullptr;
         const char *mName;
         std::size_t mNameLength;
         Type mType;
@@ -142,9 +213,10 @@ private:
     Item *allocateItem(const char *name);
     void freeItemValue(Item *item);
     const Item *findItem(const char *name, Type type) const;
+    void setArray(const char *name, Type type, const void *data, std::size_t bytes,
+                  std::size_t count);
     std::size_t findItemIndex(const char *name, std::size_t len) const;
-
-    void deliver();
+    void copyItemsTo(AMessage *msg) const;
 
     DECLARE_NON_COPYASSIGNABLE(AMessage);
 };
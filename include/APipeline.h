@@ -0,0 +1,109 @@
+#ifndef __A_PIPELINE_H__
+#define __A_PIPELINE_H__
+
+#include "ABase.h"
+#include "ALooper.h"
+#include "ASpscRing.h"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace diordna {
+
+struct AHandler;
+struct AMessage;
+
+// A linear chain of stages, each an AHandler on its own looper. Neighbouring stages are connected
+// by bounded single-producer/single-consumer rings: handing a message to the next stage is lock
+// free, and the next stage's looper is only posted to when it has drained its ring, rather than
+// once per message. Stages stay regular handlers, AMessage::post to any of them still works.
+//
+// Backpressure: a stage whose next ring is full keeps what it forwards, in order, and stops taking
+// messages from its own ring until the next stage has room for them. A full pipeline thus fills up
+// from its slowest stage back to the first ring, where push() reports WOULD_BLOCK to the source.
+struct APipeline {
+    struct StageStats {
+        std::string mName;
+        double mUtilization;  // share of the time since start() spent processing ring messages
+        uint64_t mProcessed;  // messages received through the ring
+        std::size_t mOccupancy;
+        std::size_t mMaxOccupancy;
+        std::size_t mCapacity;
+    };
+
+    explicit APipeline(std::size_t ringCapacity = 1024);
+
+    // append a stage running |handler|, which must not be registered yet. before start() only.
+    status_t addStage(const char *name, const std::shared_ptr<AHandler> &handler);
+
+    status_t start();
+    status_t stop();
+
+    // feed the first stage. must always be called from the same thread, as the only producer of
+    // the first ring. returns WOULD_BLOCK if the ring is full, the source should retry later.
+    status_t push(const std::shared_ptr<AMessage> &msg);
+
+    // hand |msg| over to the stage after the one running handler |from|. must be called on the
+    // looper thread of that stage. never blocks: if the ring is full, |msg| waits in order behind
+    // the messages already forwarded, and the stage is held back until they are all handed over.
+    // returns NAME_NOT_FOUND if |from| is not a stage or is the last one.
+    status_t forward(ALooper::handler_id from, const std::shared_ptr<AMessage> &msg);
+
+    std::shared_ptr<ALooper> getLooper(std::size_t stage) const;
+
+    std::vector<StageStats> getStats() const;
+
+    virtual ~APipeline();
+
+private:
+    // drain at most this many messages before yielding to the other events of the looper
+    enum { kMaxDrainBatch = 64 };
+
+    struct Stage {
+        Stage(const char *name, const std::shared_ptr<AHandler> &handler, std::size_t capacity);
+
+        std::string mName;
+        std::shared_ptr<AHandler> mHandler;
+        std::shared_ptr<ALooper> mLooper;
+        ASpscRing<std::shared_ptr<AMessage>> mInput;
+        // a drain task is pending or running on the looper
+        std::atomic<bool> mDrainScheduled;
+        Stage *mPrevious;
+        Stage *mNext;
+
+        // what the handler forwarded while the ring of mNext was full, in order. only touched on
+        // the looper thread
+        std::deque<std::shared_ptr<AMessage>> mOverflow;
+        // drain() stopped on a non-empty overflow, flush() restarts it once it is empty
+        bool mDrainPaused;
+        // the previous stage waits for room in mInput to flush its overflow
+        std::atomic<bool> mProducerWaiting;
+
+        std::atomic<int64_t> mBusyUs;
+        std::atomic<uint64_t> mProcessed;
+        std::atomic<std::size_t> mMaxOccupancy;
+    };
+
+    std::size_t mRingCapacity;
+    std::vector<std::unique_ptr<Stage>> mStages;
+    int64_t mStartUs;
+    bool mStarted;
+
+    status_t enqueue(Stage *stage, const std::shared_ptr<AMessage> &msg);
+    void drain(Stage *stage);
+    // hand the overflow of |stage| over to the next stage, as far as its ring has room
+    void flush(Stage *stage);
+    // have the next stage call flush() once it has made room in its ring
+    void waitForRoom(Stage *stage);
+    void notifyProducer(Stage *stage);
+
+    DECLARE_NON_COPYASSIGNABLE(APipeline);
+};
+
+}  // namespace diordna
+
+#endif  // __A_PIPELINE_H__
\ No newline at end of file
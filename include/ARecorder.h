@@ -0,0 +1,107 @@
+#ifndef __A_RECORDER_H__
+#define __A_RECORDER_H__
+
+#include "ABase.h"
+#include "ALooper.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace diordna {
+
+struct AHandler;
+struct AMessage;
+
+// Logs the messages posted to loopers (see ALooper::setRecorder) to a compact binary file, to be
+// re-posted later by an AReplayer for repeatable load tests. One recorder may be shared by several
+// loopers. Each record holds the time of the post in the looper time base, its delay, target
+// handler id, what() and items. Objects cannot be serialized and are left out, broadcasts and
+// tasks are not recorded.
+//
+// The file is a header (magic "ALRC", uint32 version) followed by the records, in host byte
+// order. Each record starts with its uint32 size so a reader can skip it, then:
+//     int64 timeUs, int64 delayUs, int32 handlerId, uint32 what, uint8 flags, uint16 numItems
+// and each item is a uint8 Type, a uint16 name length, the name, then its value: 4 or 8 bytes
+// for numbers (sizes as uint64), a uint32 length and the bytes for strings, a uint32 count and
+// the elements for arrays.
+struct ARecorder {
+    ARecorder();
+
+    status_t open(const char *path);
+    status_t close();
+
+    // messages recorded since open()
+    uint64_t recordedCount();
+
+    virtual ~ARecorder();
+
+private:
+    friend struct ALooper;  // Encode(), write()
+
+    std::mutex mLock;
+    FILE *mFile;
+    uint64_t mRecorded;
+
+    // Appends the record of |msg| to |records|. Called by the posting thread with the looper
+    // lock held, the message may be delivered and modified as soon as it is released.
+    static void Encode(int64_t timeUs, int64_t delayUs, ALooper::handler_id handlerId,
+                       const AMessage &msg, std::vector<uint8_t> *records);
+    // writes |count| encoded records, without the looper lock so that file I/O does not hold
+    // back the looper
+    void write(const std::vector<uint8_t> &records, std::size_t count);
+
+    DECLARE_NON_COPYASSIGNABLE(ARecorder);
+};
+
+// Re-posts a stream recorded by ARecorder. Messages go to the handlers registered under the same
+// ids, which holds when the same topology is set up in the same order, unless redirected with
+// mapHandler(). Messages to handlers which cannot be found are skipped.
+struct AReplayer {
+    enum Pace {
+        // keep the recorded spacing between posts, and the recorded delays
+        PACE_ORIGINAL,
+        // post everything back to back, without delays
+        PACE_FAST,
+    };
+
+    AReplayer();
+
+    status_t open(const char *path);
+    void close();
+
+    // post the messages recorded for |recordedId| to |handler| instead
+    void mapHandler(ALooper::handler_id recordedId, const std::shared_ptr<AHandler> &handler);
+
+    // Post the whole stream from the start, blocking until the last message has been posted or
+    // cancel() is called. |posted| and |skipped| receive the message counts, if not null.
+    // returns BAD_VALUE if the file is corrupted, INVALID_OPERATION if cancelled.
+    status_t replay(Pace pace, std::size_t *posted = nullptr, std::size_t *skipped = nullptr);
+    void cancel();
+
+    virtual ~AReplayer();
+
+private:
+    std::mutex mLock;
+    std::condition_variable mCancelCondition;
+    bool mCancelled;
+    FILE *mFile;
+    KeyedVector<ALooper::handler_id, std::weak_ptr<AHandler>> mHandlerMap;
+
+    // reads the next record, |msg| gets its what() and items but no target. returns
+    // NOT_ENOUGH_DATA at the end of the stream
+    status_t readRecord(int64_t *timeUs, int64_t *delayUs, ALooper::handler_id *handlerId,
+                        std::shared_ptr<AMessage> *msg);
+    // the current record, reused
+    std::vector<uint8_t> mBuffer;
+    std::shared_ptr<AHandler> findHandler(ALooper::handler_id recordedId);
+
+    DECLARE_NON_COPYASSIGNABLE(AReplayer);
+};
+
+}  // namespace diordna
+
+#endif  // __A_RECORDER_H__
\ No newline at end of file
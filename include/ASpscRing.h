@@ -0,0 +1,80 @@
+#ifndef __A_SPSC_RING_H__
+#define __A_SPSC_RING_H__
+
+#include "ABase.h"
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace diordna {
+
+// Bounded lock-free ring for exactly one producer thread and one consumer thread. The capacity is
+// rounded up to a power of two. Each side caches the other side's index, so the shared indices
+// are only read when the ring looks full, or empty.
+template <typename T>
+struct ASpscRing {
+    explicit ASpscRing(std::size_t capacity)
+        : mHead(0), mCachedTail(0), mTail(0), mCachedHead(0) {
+        std::size_t size = 1;
+        while (size < capacity) { size <<= 1; }
+        mSlots.resize(size);
+        mMask = size - 1;
+    }
+
+    std::size_t capacity() const { return mMask + 1; }
+
+    // approximate when called from neither the producer nor the consumer
+    std::size_t size() const {
+        return mTail.load(std::memory_order_acquire) - mHead.load(std::memory_order_acquire);
+    }
+
+    bool empty() const { return size() == 0; }
+
+    // producer side. returns false if the ring is full
+    bool push(T &&value) {
+        auto tail = mTail.load(std::memory_order_relaxed);
+        if (tail - mCachedHead > mMask) {
+            mCachedHead = mHead.load(std::memory_order_acquire);
+            if (tail - mCachedHead > mMask) { return false; }
+        }
+        mSlots[tail & mMask] = std::move(value);
+        mTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side. returns false if the ring is empty
+    bool pop(T *value) {
+        auto head = mHead.load(std::memory_order_relaxed);
+        if (head == mCachedTail) {
+            mCachedTail = mTail.load(std::memory_order_acquire);
+            if (head == mCachedTail) { return false; }
+        }
+        *value = std::move(mSlots[head & mMask]);
+        mSlots[head & mMask] = T();
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    enum { kCacheLineSize = 64 };
+
+    std::vector<T> mSlots;
+    std::size_t mMask;
+
+    // consumer side, kept away from the producer side to avoid false sharing
+    std::atomic<std::size_t> mHead;
+    std::size_t mCachedTail;
+    char mPadding[kCacheLineSize];
+
+    // producer side
+    std::atomic<std::size_t> mTail;
+    std::size_t mCachedHead;
+
+    DECLARE_NON_COPYASSIGNABLE(ASpscRing);
+};
+
+}  // namespace diordna
+
+#endif  // __A_SPSC_RING_H__
\ No newline at end of file
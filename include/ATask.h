@@ -0,0 +1,126 @@
+#ifndef __A_TASK_H__
+#define __A_TASK_H__
+
+#include "ABase.h"
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace diordna {
+
+// A move-only void() callable. Callables of up to kInlineSize bytes which can be moved without
+// throwing, which covers lambdas capturing a few pointers or a shared_ptr, are stored inline and
+// never touch the heap. Larger ones are heap allocated.
+struct ATask {
+    enum { kInlineSize = 6 * sizeof(void *) };
+
+    ATask() : mOps(nullptr) {}
+
+    template <typename F, typename = typename std::enable_if<
+                              !std::is_same<typename std::decay<F>::type, ATask>::value>::type,
+              typename = decltype(std::declval<typename std::decay<F>::type &>()())>
+    ATask(F &&f) : mOps(nullptr) {
+        using Callable = typename std::decay<F>::type;
+        using Storage = typename std::conditional<IsInline<Callable>::value,
+                                                  InlineStorage<Callable>,
+                                                  HeapStorage<Callable>>::type;
+        Storage::Create(mStorage, std::forward<F>(f));
+        mOps = &Storage::kOps;
+    }
+
+    ATask(ATask &&other) : mOps(other.mOps) {
+        if (mOps != nullptr) {
+            mOps->move(other.mStorage, mStorage);
+            other.mOps = nullptr;
+        }
+    }
+
+    ATask &operator=(ATask &&other) {
+        if (this != &other) {
+            reset();
+            if (other.mOps != nullptr) {
+                other.mOps->move(other.mStorage, mStorage);
+                mOps = other.mOps;
+                other.mOps = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    ~ATask() { reset(); }
+
+    explicit operator bool() const { return mOps != nullptr; }
+
+    void operator()() { mOps->invoke(mStorage); }
+
+    void reset() {
+        if (mOps != nullptr) {
+            mOps->destroy(mStorage);
+            mOps = nullptr;
+        }
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void *storage);
+        // move-construct into |to| and destroy what is left in |from|
+        void (*move)(void *from, void *to);
+        void (*destroy)(void *storage);
+    };
+
+    template <typename Callable>
+    struct IsInline {
+        enum {
+            value = sizeof(Callable) <= kInlineSize &&
+                    alignof(std::max_align_t) % alignof(Callable) == 0 &&
+                    std::is_nothrow_move_constructible<Callable>::value
+        };
+    };
+
+    template <typename Callable>
+    struct InlineStorage {
+        template <typename F>
+        static void Create(void *storage, F &&f) {
+            new (storage) Callable(std::forward<F>(f));
+        }
+        static void Invoke(void *storage) { (*static_cast<Callable *>(storage))(); }
+        static void Move(void *from, void *to) {
+            new (to) Callable(std::move(*static_cast<Callable *>(from)));
+            static_cast<Callable *>(from)->~Callable();
+        }
+        static void Destroy(void *storage) { static_cast<Callable *>(storage)->~Callable(); }
+        static constexpr Ops kOps{Invoke, Move, Destroy};
+    };
+
+    template <typename Callable>
+    struct HeapStorage {
+        template <typename F>
+        static void Create(void *storage, F &&f) {
+            *static_cast<Callable **>(storage) = new Callable(std::forward<F>(f));
+        }
+        static void Invoke(void *storage) { (**static_cast<Callable **>(storage))(); }
+        static void Move(void *from, void *to) {
+            *static_cast<Callable **>(to) = *static_cast<Callable **>(from);
+        }
+        static void Destroy(void *storage) { delete *static_cast<Callable **>(storage); }
+        static constexpr Ops kOps{Invoke, Move, Destroy};
+    };
+
+    alignas(std::max_align_t) unsigned char mStorage[kInlineSize];
+    const Ops *mOps;
+
+    ATask(const ATask &) = delete;
+    ATask &operator=(const ATask &) = delete;
+};
+
+template <typename Callable>
+constexpr ATask::Ops ATask::InlineStorage<Callable>::kOps;
+
+template <typename Callable>
+constexpr ATask::Ops ATask::HeapStorage<Callable>::kOps;
+
+}  // namespace diordna
+
+#endif  // __A_TASK_H__
\ No newline at end of file
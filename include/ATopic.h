@@ -0,0 +1,48 @@
+#ifndef __A_TOPIC_H__
+#define __A_TOPIC_H__
+
+#include "ABase.h"
+#include "ALooper.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace diordna {
+
+struct AHandler;
+struct AMessage;
+
+// Fans one message out to every subscribed handler. Subscribers are grouped by looper, so a
+// publish enqueues the message once per looper, and the message itself is never copied: every
+// subscriber receives the same instance and must treat it as read-only.
+struct ATopic {
+    ATopic();
+
+    status_t subscribe(const std::shared_ptr<AHandler> &handler);
+    status_t unsubscribe(const std::shared_ptr<AHandler> &handler);
+
+    // deliver |msg| to all current subscribers after |delayUs|. its what() is preserved, its
+    // target is ignored.
+    status_t publish(const std::shared_ptr<AMessage> &msg, int64_t delayUs = 0);
+
+private:
+    struct Group {
+        std::weak_ptr<ALooper> mLooper;
+        std::shared_ptr<const ALooper::HandlerList> mHandlers;
+    };
+
+    std::mutex mLock;
+    std::vector<std::weak_ptr<AHandler>> mSubscribers;
+    // immutable snapshot rebuilt on (un)subscription, so publishing allocates nothing
+    std::shared_ptr<const std::vector<Group>> mGroups;
+
+    void rebuildGroupsLocked();
+
+    DECLARE_NON_COPYASSIGNABLE(ATopic);
+};
+
+}  // namespace diordna
+
+#endif  // __A_TOPIC_H__
\ No newline at end of file
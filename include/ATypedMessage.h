@@ -0,0 +1,78 @@
+#ifndef __A_TYPED_MESSAGE_H__
+#define __A_TYPED_MESSAGE_H__
+
+#include "ABase.h"
+#include "AMessage.h"
+
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace diordna {
+
+// A message carrying an inline, statically typed |Payload| next to the named items. It is posted
+// and delivered like any AMessage, handlers get the payload back with From() instead of looking
+// fields up by name. The payload lives in the message allocation itself. A plain struct is
+// brace-initialized from the arguments, other payloads are built by their constructor.
+//
+//     auto msg = std::make_shared<ATypedMessage<Frame>>(kWhatFrame, handler, width, height);
+//     msg->post();
+//     ...
+//     if (auto *frame = ATypedMessage<Frame>::From(msg)) { process(frame->payload()); }
+template <typename Payload>
+struct ATypedMessage : public AMessage {
+    template <typename... Args>
+    ATypedMessage(uint32_t what, const std::shared_ptr<const AHandler> &handler, Args &&... args)
+        : ATypedMessage(typename std::conditional<std::is_constructible<Payload, Args...>::value,
+                                                  ConstructInit, BraceInit>::type(),
+                        what, handler, std::forward<Args>(args)...) {}
+
+    Payload &payload() { return mPayload; }
+    const Payload &payload() const { return mPayload; }
+
+    // the typed message behind |msg|, or nullptr if it does not carry a Payload
+    static ATypedMessage *From(const std::shared_ptr<AMessage> &msg) {
+        if (msg == nullptr || msg->mPayloadTag != Tag()) { return nullptr; }
+        return static_cast<ATypedMessage *>(msg.get());
+    }
+
+    // copies the payload along with the items
+    std::shared_ptr<AMessage> dup() const override {
+        auto msg = std::make_shared<ATypedMessage>(what(), mHandler.lock(), mPayload);
+        copyItemsTo(msg.get());
+        return msg;
+    }
+
+private:
+    Payload mPayload;
+
+    struct ConstructInit {};
+    struct BraceInit {};  // aggregates cannot be built with parentheses before C++20
+
+    template <typename... Args>
+    ATypedMessage(ConstructInit, uint32_t what, const std::shared_ptr<const AHandler> &handler,
+                  Args &&... args)
+        : AMessage(what, handler), mPayload(std::forward<Args>(args)...) {
+        mPayloadTag = Tag();
+    }
+
+    template <typename... Args>
+    ATypedMessage(BraceInit, uint32_t what, const std::shared_ptr<const AHandler> &handler,
+                  Args &&... args)
+        : AMessage(what, handler), mPayload{std::forward<Args>(args)...} {
+        mPayloadTag = Tag();
+    }
+
+    // one unique address per payload type, compared instead of using RTTI
+    static const void *Tag() {
+        static const char tag = 0;
+        return &tag;
+    }
+
+    DECLARE_NON_COPYASSIGNABLE(ATypedMessage);
+};
+
+}  // namespace diordna
+
+#endif  // __A_TYPED_MESSAGE_H__
\ No newline at end of file
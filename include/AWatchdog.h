@@ -0,0 +1,69 @@
+#ifndef __A_WATCHDOG_H__
+#define __A_WATCHDOG_H__
+
+#include "ABase.h"
+#include "ALooper.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace diordna {
+
+// Reports handlers blocking their looper. A background thread samples the delivery in progress
+// on each watched looper every |checkIntervalUs|, and reports it once when it has been running
+// for longer than the looper's budget.
+struct AWatchdog {
+    struct Stall {
+        std::string mLooperName;
+        ALooper::handler_id mHandlerId;  // 0 for tasks
+        uint32_t mWhat;
+        int64_t mElapsedUs;
+    };
+
+    using Callback = std::function<void(const Stall &stall)>;
+
+    explicit AWatchdog(int64_t checkIntervalUs = 100000);
+
+    // |budgetUs| is the longest a single delivery may take on |looper|. watching a looper again
+    // updates its budget.
+    status_t watch(const std::shared_ptr<ALooper> &looper, int64_t budgetUs);
+    status_t unwatch(const std::shared_ptr<ALooper> &looper);
+
+    // called on the watchdog thread for every stall, stalls are logged by default
+    void setCallback(const Callback &callback);
+
+    status_t start();
+    status_t stop();
+
+    virtual ~AWatchdog();
+
+private:
+    struct Watched {
+        std::weak_ptr<ALooper> mLooper;
+        int64_t mBudgetUs;
+        uint64_t mReportedSeq;  // the last delivery reported, not to report it twice
+    };
+
+    std::mutex mLock;
+    std::condition_variable mCondition;
+    int64_t mCheckIntervalUs;
+    std::vector<Watched> mWatched;
+    Callback mCallback;
+    std::thread mThread;
+    bool mRunning;
+
+    void threadLoop();
+    void checkLocked(std::vector<Stall> *stalls);
+
+    DECLARE_NON_COPYASSIGNABLE(AWatchdog);
+};
+
+}  // namespace diordna
+
+#endif  // __A_WATCHDOG_H__
\ No newline at end of file
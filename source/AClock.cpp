@@ -0,0 +1,102 @@
+#define TAG "AClock"
+
+#include <AClock.h>
+#include <ALooper.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace diordna {
+
+AVirtualClock::AVirtualClock(int64_t startUs, bool autoAdvance)
+    : mNowUs(startUs), mAutoAdvance(autoAdvance) {}
+
+int64_t AVirtualClock::nowUs() {
+    std::lock_guard<std::mutex> _lock(mLock);
+    return mNowUs;
+}
+
+void AVirtualClock::advanceUs(int64_t deltaUs) {
+    std::vector<std::shared_ptr<ALooper>> loopers;
+    {
+        std::lock_guard<std::mutex> _lock(mLock);
+        if (deltaUs > 0) { mNowUs = (deltaUs > INT64_MAX - mNowUs ? INT64_MAX : mNowUs + deltaUs); }
+
+        for (auto &it : mLoopers) {
+            auto looper = it.second.mLooper.lock();
+            if (looper == nullptr) { continue; }
+            it.second.mBusy = true;
+            loopers.push_back(looper);
+        }
+    }
+
+    // must not hold our lock, loopers call into the clock with theirs held
+    for (const auto &looper : loopers) { looper->wake(); }
+}
+
+void AVirtualClock::setAutoAdvance(bool autoAdvance) {
+    std::vector<std::shared_ptr<ALooper>> loopers;
+    {
+        std::lock_guard<std::mutex> _lock(mLock);
+        mAutoAdvance = autoAdvance;
+        advanceIfIdleLocked(&loopers);
+    }
+
+    for (const auto &looper : loopers) { looper->wake(); }
+}
+
+void AVirtualClock::attach(const std::shared_ptr<ALooper> &looper, bool busy,
+                           int64_t deadlineUs) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    mLoopers[looper.get()] = LooperState{looper, busy, deadlineUs};
+}
+
+void AVirtualClock::detach(const ALooper *looper) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    mLoopers.erase(looper);
+}
+
+void AVirtualClock::onBusy(const ALooper *looper) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    auto it = mLoopers.find(looper);
+    if (it != mLoopers.end()) { it->second.mBusy = true; }
+}
+
+std::vector<std::shared_ptr<ALooper>> AVirtualClock::onIdle(const ALooper *looper,
+                                                            int64_t deadlineUs) {
+    std::vector<std::shared_ptr<ALooper>> loopers;
+
+    std::lock_guard<std::mutex> _lock(mLock);
+    auto it = mLoopers.find(looper);
+    if (it == mLoopers.end()) { return loopers; }
+
+    it->second.mBusy = false;
+    it->second.mDeadlineUs = deadlineUs;
+    advanceIfIdleLocked(&loopers);
+    return loopers;
+}
+
+void AVirtualClock::advanceIfIdleLocked(std::vector<std::shared_ptr<ALooper>> *loopers) {
+    if (!mAutoAdvance) { return; }
+
+    int64_t deadlineUs = INT64_MAX;
+    for (const auto &it : mLoopers) {
+        if (it.second.mBusy) { return; }
+        if (it.second.mDeadlineUs < deadlineUs) { deadlineUs = it.second.mDeadlineUs; }
+    }
+
+    // everything is idle with nothing scheduled, time stands still
+    if (deadlineUs == INT64_MAX) { return; }
+    if (deadlineUs > mNowUs) { mNowUs = deadlineUs; }
+
+    for (auto &it : mLoopers) {
+        if (it.second.mDeadlineUs > mNowUs) { continue; }
+        auto looper = it.second.mLooper.lock();
+        if (looper == nullptr) { continue; }
+        it.second.mBusy = true;
+        loopers->push_back(looper);
+    }
+}
+
+}  // namespace diordna
\ No newline at end of file
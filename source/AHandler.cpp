@@ -7,11 +7,16 @@ namespace diordna {
 
 void AHandler::deliverMessage(const std::shared_ptr<AMessage> &msg) {
     onMessageReceived(msg);
-    ++mMessageCounter;
+    mMessageCounter.fetch_add(1, std::memory_order_relaxed);
     if (mVerboseStats) {
         auto what = msg->what();
         mMessages[what]++;
     }
 }
 
+void AHandler::expireMessage(const std::shared_ptr<AMessage> &msg) {
+    mExpiredCounter.fetch_add(1, std::memory_order_relaxed);
+    onMessageExpired(msg);
+}
+
 }  // namespace diordna
\ No newline at end of file
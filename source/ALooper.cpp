@@ -1,17 +1,29 @@
 #define TAG "ALooper"
 
+#include <AClock.h>
 #include <AHandler.h>
 #include <ALooper.h>
 #include <ALooperRoster.h>
 #include <AMessage.h>
+#include <ARecorder.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif  // __linux__
+
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <chrono>
-#include <future>
+#include <climits>
+#include <iterator>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
 using namespace std::chrono_literals;
 
@@ -19,48 +31,64 @@ namespace diordna {
 
 ALooperRoster gLooperRoster;
 
+// the looper whose loop is running on the calling thread, if any
+static thread_local ALooper *sCurrentLooper = nullptr;
+
+// records encoded with the looper lock held, written to the recorder once it is released, reused
+static thread_local std::vector<uint8_t> sRecords;
+
 struct ALooper::LooperThread {
-    explicit LooperThread(ALooper *looper) : mLooper(looper), mStopped(false) {
-        mThreadId = std::this_thread::get_id();
-    }
+    explicit LooperThread(ALooper *looper) : mLooper(looper) {}
 
     void run() {
-        mThread = std::thread([this]() { this->threadLoop(this->mExitSignal.get_future()); });
-        mThread.detach();
-        mStopped = false;
+        // the thread only touches the looper, it may outlive this object when stopped from
+        // within one of its own handlers
+        mThread = std::thread([looper = mLooper]() { threadLoop(looper); });
     }
 
+    // waits for the thread to leave its loop, unless called from the looper thread itself
     void stop() {
-        if (mStopped) { return; }
-        mExitSignal.set_value();
-        mStopped = true;
+        if (!mThread.joinable()) { return; }
+        if (isCurrentThread()) {
+            mThread.detach();
+        } else {
+            mThread.join();
+        }
     }
 
-    virtual ~LooperThread() {
-        if (!mStopped) { stop(); }
-    }
+    virtual ~LooperThread() { stop(); }
 
-    bool isCurrentThread() const { return std::this_thread::get_id() == mThreadId; }
+    bool isCurrentThread() const { return mLooper->isCurrentThread(); }
 
 private:
     ALooper *mLooper;
-    std::thread::id mThreadId;
     std::thread mThread;
-    std::promise<void> mExitSignal;
-    bool mStopped;
 
-    void threadLoop(std::future<void> exitListner) {
+    static void threadLoop(ALooper *looper) {
         LOG("start %s", __func__);
-        do {
-            if (!mLooper->loop()) {
-                LOG("some errors happen, exiting thread loop...");
-                break;
-            }
-        } while (exitListner.wait_for(std::chrono::nanoseconds(1)) == std::future_status::timeout);
+        sCurrentLooper = looper;
+        while (looper->loop()) {
+        }
+        sCurrentLooper = nullptr;
         LOG("exit %s", __func__);
     }
 };
 
+struct ALooper::BlockedCall {
+    BlockedCall() : mLooper(sCurrentLooper) {
+        if (mLooper != nullptr) { mLooper->setBlocked(true); }
+    }
+
+    ~BlockedCall() {
+        if (mLooper != nullptr) { mLooper->setBlocked(false); }
+    }
+
+private:
+    ALooper *mLooper;
+
+    DECLARE_NON_COPYASSIGNABLE(BlockedCall);
+};
+
 // static
 int64_t ALooper::GetNowUs() {
     // FIXME: ???
@@ -70,18 +98,159 @@ int64_t ALooper::GetNowUs() {
     return nowUs.count();
 }
 
-ALooper::ALooper() : mRunningLocally(false) { gLooperRoster.unregisterStaleHandlers(); }
+ALooper::ALooper()
+    : mTimerSlackUs(0),
+      mStats{},
+      mDeliverySeq(0),
+      mDeliveryHandlerId(0),
+      mDeliveryWhat(0),
+      mDeliveryStartUs(0),
+      mBusyUs(0),
+      mFairScheduling(false),
+      mFairQuantumUs(1000),
+      mFairTurnStarted(false),
+      mFairChargeKey(0),
+      mFairChargeUs(0),
+      mFairChargePending(false),
+      mNextBarrierToken(1),
+      mNextPeriodicToken(1),
+      mNextIdleHandlerId(1),
+      mIdleHandlersRan(false),
+      mEpollFd(-1),
+      mWakeFd(-1),
+      mNextFdSeq(0),
+      mDeliveriesSinceFdPoll(0),
+      mRunningLocally(false),
+      mStopped(false) {
+    gLooperRoster.unregisterStaleHandlers();
+}
 
-ALooper::~ALooper() { stop(); }
+ALooper::~ALooper() {
+    stop();
+    if (mClock != nullptr) { mClock->detach(this); }
+#ifdef __linux__
+    if (mEpollFd >= 0) { close(mEpollFd); }
+    if (mWakeFd >= 0) { close(mWakeFd); }
+#endif  // __linux__
+}
 
 void ALooper::setName(const char *name) { mName = std::string{name}; }
 
-ALooper::handler_id ALooper::registerHandler(const std::shared_ptr<AHandler> &handler) {
-    return gLooperRoster.registerHandler(shared_from_this(), handler);
+void ALooper::setTimerSlackUs(int64_t slackUs) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    mTimerSlackUs = slackUs > 0 ? slackUs : 0;
+    wakeLocked();
+}
+
+void ALooper::setClock(const std::shared_ptr<AClock> &clock) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    if (mClock == clock) { return; }
+    if (mClock != nullptr) { mClock->detach(this); }
+
+    mClock = clock;
+    if (mClock != nullptr) {
+        // a running looper re-evaluates its queue in the new time base, and reports idle then
+        auto deadlineUs = (mEventQueue.empty() ? INT64_MAX : mEventQueue.begin()->mWhenUs);
+        mClock->attach(shared_from_this(), isRunningLocked(), deadlineUs);
+    }
+    wakeLocked();
+}
+
+int64_t ALooper::nowUs() {
+    std::lock_guard<std::mutex> _lock(mLock);
+    return nowUsLocked();
+}
+
+int64_t ALooper::nowUsLocked() { return mClock != nullptr ? mClock->nowUs() : GetNowUs(); }
+
+int32_t ALooper::addIdleHandler(const IdleHandler &handler) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    auto id = mNextIdleHandlerId++;
+    mIdleHandlers.push_back(IdleEntry{id, std::make_shared<IdleHandler>(handler)});
+    // an idle looper gets to run it without waiting for another message first
+    mIdleHandlersRan = false;
+    wakeLocked();
+    return id;
+}
+
+status_t ALooper::removeIdleHandler(int32_t id) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    for (auto it = mIdleHandlers.begin(); it != mIdleHandlers.end(); ++it) {
+        if (it->mId == id) {
+            mIdleHandlers.erase(it);
+            return OK;
+        }
+    }
+    return NAME_NOT_FOUND;
+}
+
+ALooper::Stats ALooper::getStats() {
+    std::lock_guard<std::mutex> _lock(mLock);
+    Stats stats = mStats;
+    stats.mBusyUs = mBusyUs.load(std::memory_order_relaxed);
+    return stats;
+}
+
+ALooper::Delivery ALooper::getCurrentDelivery() const {
+    // the sequence is odd while the looper thread updates the fields
+    Delivery delivery;
+    do {
+        delivery.mSeq = mDeliverySeq.load(std::memory_order_acquire);
+        delivery.mHandlerId = mDeliveryHandlerId.load(std::memory_order_relaxed);
+        delivery.mWhat = mDeliveryWhat.load(std::memory_order_relaxed);
+        delivery.mStartUs = mDeliveryStartUs.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((delivery.mSeq & 1) || delivery.mSeq != mDeliverySeq.load(std::memory_order_relaxed));
+    return delivery;
+}
+
+void ALooper::dump(int fd) {
+    auto stats = getStats();
+    auto delivery = getCurrentDelivery();
+
+    dprintf(fd, "looper \"%s\": wakeups %llu (timed %llu), delivered %llu, expired %llu\n",
+            mName.c_str(), (unsigned long long)stats.mWakeups,
+            (unsigned long long)stats.mTimedWakeups, (unsigned long long)stats.mDelivered,
+            (unsigned long long)stats.mExpired);
+    dprintf(fd, "  queue depth %zu (max %zu), approx. %zu bytes (max %zu)\n", stats.mQueueDepth,
+            stats.mMaxQueueDepth, stats.mQueueBytes, stats.mMaxQueueBytes);
+    if (delivery.mStartUs != 0) {
+        dprintf(fd, "  delivering what %u to handler %d for %lld us\n", delivery.mWhat,
+                delivery.mHandlerId, (long long)(GetNowUs() - delivery.mStartUs));
+    }
+}
+
+void ALooper::setRecorder(const std::shared_ptr<ARecorder> &recorder) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    mRecorder = recorder;
+}
+
+ALooper::handler_id ALooper::registerHandler(const std::shared_ptr<AHandler> &handler,
+                                             bool retain) {
+    auto handlerId = gLooperRoster.registerHandler(shared_from_this(), handler);
+    if (retain && handlerId > 0) {
+        std::lock_guard<std::mutex> _lock(mLock);
+        mRetained[handlerId] = handler;
+    }
+    return handlerId;
 }
 
 void ALooper::unregisterHandler(ALooper::handler_id handlerId) {
+    // a retained handler is released by the looper it runs on now, not necessarily this one
+    std::shared_ptr<AHandler> handler = gLooperRoster.findHandler(handlerId);
+    std::shared_ptr<ALooper> looper = handler != nullptr ? handler->looper() : nullptr;
     gLooperRoster.unregisterHandler(handlerId);
+    if (looper != nullptr) { looper->releaseRetained(handlerId); }
+}
+
+void ALooper::releaseRetained(handler_id handlerId) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    auto it = mRetained.find(handlerId);
+    if (it == mRetained.end()) { return; }
+
+    // it may be delivered to right now, even be the caller, let the looper thread drop it after
+    enqueueLocked(Event{whenUsLocked(0), nullptr, [handler = std::move(it->second)]() {}});
+    mRetained.erase(it);
 }
 
 status_t ALooper::start(bool runOnCallingThread) {
@@ -90,10 +259,15 @@ status_t ALooper::start(bool runOnCallingThread) {
             std::lock_guard<std::mutex> _lock(mLock);
             if (mThread != nullptr || mRunningLocally) { return INVALID_OPERATION; }
             mRunningLocally = true;
+            mStopped = false;
+            if (mClock != nullptr) { mClock->onBusy(this); }
         }
 
+        auto previousLooper = sCurrentLooper;
+        sCurrentLooper = this;
         do {
         } while (loop());
+        sCurrentLooper = previousLooper;
 
         return OK;
     }
@@ -101,6 +275,8 @@ status_t ALooper::start(bool runOnCallingThread) {
     std::lock_guard<std::mutex> _lock(mLock);
     if (mThread != nullptr || mRunningLocally) { return INVALID_OPERATION; }
 
+    if (mClock != nullptr) { mClock->onBusy(this); }
+    mStopped = false;
     mThread = std::make_shared<LooperThread>(this);
     mThread->run();
     return OK;
@@ -111,80 +287,1115 @@ status_t ALooper::stop() {
     bool runningLocally;
 
     {
-        std::lock_guard<std::mutex> _lock(mLock);
+        std::unique_lock<std::mutex> _lock(mLock);
         _thread = mThread;
         runningLocally = mRunningLocally;
         mThread = nullptr;
         mRunningLocally = false;
+        mStopped = true;
+        wakeLocked();
+        // a stopped looper must not hold back the other loopers of a manual clock
+        if (mClock != nullptr && mClock->isManual()) { reportIdleLocked(_lock, INT64_MAX); }
     }
 
     if (_thread == nullptr && !runningLocally) { return INVALID_OPERATION; }
 
-    if (_thread != nullptr) { _thread->stop(); }
-
-    mQueueChangedCondition.notify_one();
     {
         std::lock_guard<std::mutex> _lock(mRepliesLock);
         mRepliesCondition.notify_all();
     }
 
-    // XXX: check if _thread is nullptr? and stop twice?
-    if (!runningLocally && !_thread->isCurrentThread()) { _thread->stop(); }
+    if (_thread != nullptr) { _thread->stop(); }
+
+    return OK;
+}
+
+void ALooper::post(std::shared_ptr<AMessage> msg, int64_t delayUs) {
+    std::shared_ptr<ALooper> target;
+    std::shared_ptr<ARecorder> recorder;
+    {
+        std::lock_guard<std::mutex> _lock(mLock);
+        target = migratedToLocked(msg->mTarget);
+        if (target == nullptr) {
+            if (mRecorder != nullptr) {
+                recorder = mRecorder;
+                sRecords.clear();
+                ARecorder::Encode(nowUsLocked(), delayUs, msg->mTarget, *msg, &sRecords);
+            }
+            enqueueLocked(Event{whenUsLocked(delayUs), std::move(msg)});
+        }
+    }
+    if (target == nullptr) {
+        if (recorder != nullptr) { recorder->write(sRecords, 1); }
+        return;
+    }
+
+    // the handler moved away, follow it
+    msg->mLooper = target;
+    target->post(std::move(msg), delayUs);
+}
+
+status_t ALooper::postDirect(std::shared_ptr<AMessage> &&msg, handler_id handlerId,
+                             int64_t delayUs) {
+    if (msg == nullptr) { return BAD_VALUE; }
+    msg->mTarget = handlerId;
+
+    std::shared_ptr<ALooper> target;
+    std::shared_ptr<ARecorder> recorder;
+    {
+        std::lock_guard<std::mutex> _lock(mLock);
+        if (mRetained.find(handlerId) == mRetained.end()) {
+            target = migratedToLocked(handlerId);
+            if (target == nullptr) { return NAME_NOT_FOUND; }
+        } else {
+            if (mRecorder != nullptr) {
+                recorder = mRecorder;
+                sRecords.clear();
+                ARecorder::Encode(nowUsLocked(), delayUs, handlerId, *msg, &sRecords);
+            }
+            enqueueLocked(Event{whenUsLocked(delayUs), std::move(msg)});
+        }
+    }
+    if (target == nullptr) {
+        if (recorder != nullptr) { recorder->write(sRecords, 1); }
+        return OK;
+    }
+
+    // the handler moved away, follow it
+    return target->postDirect(std::move(msg), handlerId, delayUs);
+}
+
+status_t ALooper::postBatch(const BatchEntry *entries, std::size_t count) {
+    // compares control blocks, without touching the reference counts of each message's looper
+    std::weak_ptr<ALooper> self = shared_from_this();
+    for (std::size_t i = 0; i < count; ++i) {
+        const auto &msg = entries[i].mMessage;
+        if (msg == nullptr || msg->mLooper.owner_before(self) || self.owner_before(msg->mLooper)) {
+            LOG("E : batch entry %zu does not target looper %s", i, mName.c_str());
+            return BAD_VALUE;
+        }
+    }
+
+    std::vector<Event> events;
+    events.reserve(count);
+
+    std::unique_lock<std::mutex> _lock(mLock);
+    if (!mMigrated.empty()) {
+        for (std::size_t i = 0; i < count; ++i) {
+            if (migratedToLocked(entries[i].mMessage->mTarget) == nullptr) { continue; }
+            // some must be forwarded, which post() takes care of
+            _lock.unlock();
+            for (std::size_t j = 0; j < count; ++j) {
+                post(entries[j].mMessage, entries[j].mDelayUs);
+            }
+            return OK;
+        }
+    }
+
+    auto nowUs = nowUsLocked();
+    std::shared_ptr<ARecorder> recorder = mRecorder;
+    if (recorder != nullptr) { sRecords.clear(); }
+    for (std::size_t i = 0; i < count; ++i) {
+        auto delayUs = entries[i].mDelayUs;
+        if (recorder != nullptr) {
+            ARecorder::Encode(nowUs, delayUs, entries[i].mMessage->mTarget,
+                              *entries[i].mMessage, &sRecords);
+        }
+        int64_t whenUs = nowUs;
+        if (delayUs > 0) { whenUs = (delayUs > INT64_MAX - nowUs ? INT64_MAX : nowUs + delayUs); }
+        events.push_back(Event{whenUs, entries[i].mMessage});
+    }
+    std::stable_sort(events.begin(), events.end(), [](const Event &a, const Event &b) {
+        return a.mWhenUs < b.mWhenUs;
+    });
+
+    // both sides are sorted, merge them in a single pass
+    bool headChanged = false;
+    auto it = mEventQueue.begin();
+    for (auto &event : events) {
+        while (it != mEventQueue.end() && (*it).mWhenUs <= event.mWhenUs) { ++it; }
+        if (it == mEventQueue.begin() || isReleasedByBarrierLocked(event)) { headChanged = true; }
+        accountEnqueuedLocked(event);
+        mEventQueue.insert(it, std::move(event));
+    }
+
+    if (headChanged) { headChangedLocked(); }
+    _lock.unlock();
+
+    if (recorder != nullptr) { recorder->write(sRecords, count); }
+    return OK;
+}
+
+int32_t ALooper::postPeriodic(const std::shared_ptr<AMessage> &msg, int64_t periodUs,
+                              PeriodicPolicy policy, int64_t delayUs) {
+    if (msg == nullptr || periodUs <= 0) { return BAD_VALUE; }
+    std::weak_ptr<ALooper> self = shared_from_this();
+    if (msg->mLooper.owner_before(self) || self.owner_before(msg->mLooper)) {
+        LOG("E : periodic message does not target looper %s", mName.c_str());
+        return BAD_VALUE;
+    }
+
+    std::lock_guard<std::mutex> _lock(mLock);
+    auto token = mNextPeriodicToken++;
+    mPeriodicTokens.insert(token);
+
+    Event event{whenUsLocked(delayUs), msg};
+    event.mPeriodicToken = token;
+    event.mPeriodUs = periodUs;
+    event.mCatchUp = policy == PERIODIC_CATCH_UP;
+    enqueueLocked(std::move(event));
+    return token;
+}
+
+template <typename Predicate>
+bool ALooper::eraseEventLocked(Predicate predicate) {
+    for (auto it = mEventQueue.begin(); it != mEventQueue.end(); ++it) {
+        if (!predicate(*it)) { continue; }
+        accountDequeuedLocked(*it);
+        mEventQueue.erase(it);
+        return true;
+    }
+    for (auto ready = mFairQueues.begin(); ready != mFairQueues.end(); ++ready) {
+        auto &readyEvents = ready->second.mEvents;
+        for (auto it = readyEvents.begin(); it != readyEvents.end(); ++it) {
+            if (!predicate(*it)) { continue; }
+            accountDequeuedLocked(*it);
+            readyEvents.erase(it);
+            if (readyEvents.empty()) { dropFairQueueLocked(ready); }
+            return true;
+        }
+    }
+    return false;
+}
+
+status_t ALooper::cancelPeriodic(int32_t token) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    if (mPeriodicTokens.erase(token) == 0) { return NAME_NOT_FOUND; }
+
+    // either queued, ready under fair scheduling, or being delivered and not rescheduled
+    eraseEventLocked([token](const Event &event) { return event.mPeriodicToken == token; });
+    return OK;
+}
+
+void ALooper::reschedulePeriodic(std::list<Event> *current) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    auto &event = current->front();
+    if (mPeriodicTokens.find(event.mPeriodicToken) == mPeriodicTokens.end()) { return; }
+
+    // from the deadline of the tick, not from now, so late ticks do not shift the next ones
+    auto periodUs = event.mPeriodUs;
+    auto whenUs = event.mWhenUs;
+    whenUs = (whenUs > INT64_MAX - periodUs ? INT64_MAX : whenUs + periodUs);
+    auto nowUs = nowUsLocked();
+    if (!event.mCatchUp && whenUs <= nowUs) {
+        auto missed = (nowUs - whenUs) / periodUs + 1;
+        whenUs = (missed > (INT64_MAX - whenUs) / periodUs ? INT64_MAX
+                                                           : whenUs + missed * periodUs);
+    }
+    event.mWhenUs = whenUs;
+    enqueueLocked(current);
+}
+
+status_t ALooper::migrateHandler(const std::shared_ptr<AHandler> &handler,
+                                 const std::shared_ptr<ALooper> &target) {
+    if (handler == nullptr || target == nullptr) { return BAD_VALUE; }
+    if (handler->looper().get() != this) {
+        LOG("E : handler %d does not run on looper %s", handler->id(), mName.c_str());
+        return BAD_VALUE;
+    }
+    if (target.get() == this) { return OK; }
+
+    bool running;
+    {
+        std::lock_guard<std::mutex> _lock(mLock);
+        running = isRunningLocked();
+    }
+    // nothing is being delivered by a stopped looper
+    if (!running) { return moveHandler(handler, target); }
+
+    // a delivery of this looper, maybe to |handler| itself, is running: move once it is done
+    if (isCurrentThread()) {
+        return post([this, handler, target]() {
+            auto err = moveHandler(handler, target);
+            if (err != OK) {
+                LOG("E : failed to migrate handler %d from looper %s: %d", handler->id(),
+                    mName.c_str(), err);
+            }
+        });
+    }
+
+    // in between two deliveries, so the handler is not running meanwhile
+    auto result = std::make_shared<status_t>(OK);
+    auto err = postAndWait([this, handler, target, result]() {
+        *result = moveHandler(handler, target);
+    });
+    return err != OK ? err : *result;
+}
+
+status_t ALooper::moveHandler(const std::shared_ptr<AHandler> &handler,
+                              const std::shared_ptr<ALooper> &target) {
+    auto handlerId = handler->id();
+    bool headChanged = false;
+    {
+        std::unique_lock<std::mutex> _lock(mLock, std::defer_lock);
+        std::unique_lock<std::mutex> _targetLock(target->mLock, std::defer_lock);
+        std::lock(_lock, _targetLock);
+
+        if (handler->looper().get() != this) { return BAD_VALUE; }
+
+        // the delays left are preserved when the loopers do not share a time base
+        bool rebase = mClock != target->mClock;
+        auto nowUs = rebase ? nowUsLocked() : 0;
+        auto targetNowUs = rebase ? target->nowUsLocked() : 0;
+
+        // the events of the handler which are already due under fair scheduling come first
+        std::list<Event> events;
+        // periodic messages stay, see postPeriodic
+        auto ready = mFairQueues.find(handlerId);
+        if (ready != mFairQueues.end()) {
+            auto &readyEvents = ready->second.mEvents;
+            for (auto it = readyEvents.begin(); it != readyEvents.end();) {
+                auto current = it++;
+                if (current->mPeriodicToken != 0) { continue; }
+                events.splice(events.end(), readyEvents, current);
+            }
+            if (readyEvents.empty()) { dropFairQueueLocked(ready); }
+        }
+        for (auto it = mEventQueue.begin(); it != mEventQueue.end();) {
+            auto current = it++;
+            if (FairKey(*current) != handlerId || current->mPeriodicToken != 0) { continue; }
+            events.splice(events.end(), mEventQueue, current);
+        }
+
+        // both are sorted, merge them in a single pass. the ready events may be slightly out of
+        // order when asynchronous ones went through a barrier, restart from the head then.
+        auto to = target->mEventQueue.begin();
+        int64_t lastWhenUs = INT64_MIN;
+        while (!events.empty()) {
+            auto &event = events.front();
+            accountDequeuedLocked(event);
+
+            if (rebase && event.mWhenUs != INT64_MAX) {
+                auto delayUs = event.mWhenUs - nowUs;
+                event.mWhenUs = (delayUs > INT64_MAX - targetNowUs ? INT64_MAX
+                                                                   : targetNowUs + delayUs);
+            }
+            if (event.mWhenUs < lastWhenUs) { to = target->mEventQueue.begin(); }
+            lastWhenUs = event.mWhenUs;
+
+            while (to != target->mEventQueue.end() && (*to).mWhenUs <= event.mWhenUs) { ++to; }
+            if (to == target->mEventQueue.begin() || target->isReleasedByBarrierLocked(event)) {
+                headChanged = true;
+            }
+            event.mMessage->mLooper = target;
+            target->accountEnqueuedLocked(event);
+            target->mEventQueue.splice(to, events, events.begin());
+        }
+
+        // from now on posts to this looper are forwarded, and the target stops forwarding if
+        // the handler is coming back
+        mMigrated[handlerId] = target;
+        target->mMigrated.erase(handlerId);
+        handler->setLooper(target);
+
+        auto retained = mRetained.find(handlerId);
+        if (retained != mRetained.end()) {
+            target->mRetained[handlerId] = std::move(retained->second);
+            mRetained.erase(retained);
+        }
+
+#ifdef __linux__
+        // its fds are watched by the target, a ready fd left here would wake this looper up
+        // again and again until the handler reads it over there
+        for (auto it = mFdRequests.begin(); it != mFdRequests.end();) {
+            auto current = it++;
+            if (current->second.mHandler.lock() != handler) { continue; }
+
+            auto fd = current->first;
+            auto request = current->second;
+            mFdRequests.erase(current);
+            if (epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, nullptr) < 0 && errno != EBADF) {
+                LOG("W : failed to unwatch fd %d, errno %d", fd, errno);
+            }
+            if (target->addFdLocked(fd, request.mEvents, handler, request.mWhat) != OK) {
+                LOG("E : fd %d of handler %d is not watched anymore", fd, handlerId);
+                continue;
+            }
+            if (!request.mPending) { continue; }
+
+            // its event moved along above, it still has to be delivered before polling again
+            auto &moved = target->mFdRequests[fd];
+            for (auto &event : target->mEventQueue) {
+                if (event.mFd != fd || event.mFdSeq != request.mSeq) { continue; }
+                event.mFdSeq = moved.mSeq;
+                moved.mPending = true;
+                break;
+            }
+        }
+#endif  // __linux__
+
+        if (headChanged) { target->headChangedLocked(); }
+    }
+
+    gLooperRoster.moveHandler(handlerId, target);
+    LOG("migrated handler %d from looper %s to %s", handlerId, mName.c_str(),
+        target->mName.c_str());
+    return OK;
+}
+
+std::shared_ptr<ALooper> ALooper::migratedToLocked(handler_id handlerId) {
+    if (mMigrated.empty()) { return nullptr; }
+
+    auto it = mMigrated.find(handlerId);
+    if (it == mMigrated.end()) { return nullptr; }
+
+    std::shared_ptr<ALooper> looper = it->second.lock();
+    if (looper == nullptr) { mMigrated.erase(it); }
+    return looper;
+}
+
+status_t ALooper::post(ATask &&task, int64_t delayUs) {
+    if (!task) { return BAD_VALUE; }
+
+    std::lock_guard<std::mutex> _lock(mLock);
+    enqueueLocked(Event{whenUsLocked(delayUs), nullptr, std::move(task)});
+    return OK;
+}
+
+status_t ALooper::postAndWait(ATask &&task) {
+    if (!task) { return BAD_VALUE; }
+
+    // waiting for ourselves would never return
+    if (isCurrentThread()) {
+        task();
+        return OK;
+    }
+
+    // shared with the queued task, which may still be pending when the looper stops. the flags
+    // are guarded by mRepliesLock.
+    struct Completion {
+        ATask mTask;
+        bool mStarted;
+        bool mAbandoned;
+        bool mDone;
+    };
+    auto completion =
+        std::make_shared<Completion>(Completion{std::move(task), false, false, false});
+
+    {
+        std::lock_guard<std::mutex> _lock(mLock);
+        if (!isRunningLocked()) { return NAME_NOT_FOUND; }
+
+        Event event{whenUsLocked(0), nullptr, [this, completion]() {
+                        {
+                            std::lock_guard<std::mutex> _lock(mRepliesLock);
+                            if (completion->mAbandoned) { return; }
+                            completion->mStarted = true;
+                        }
+                        completion->mTask();
+                        std::lock_guard<std::mutex> _lock(mRepliesLock);
+                        completion->mDone = true;
+                        mRepliesCondition.notify_all();
+                    }};
+        event.mCompletion = completion.get();
+        enqueueLocked(std::move(event));
+    }
+
+    BlockedCall blocked;
+    std::unique_lock<std::mutex> _lock(mRepliesLock);
+    while (!completion->mDone) {
+        {
+            std::lock_guard<std::mutex> _lock_l(mLock);
+            // a task already started is completed by the looper thread before it leaves
+            if (!isRunningLocked() && !completion->mStarted) {
+                // the task, and what it refers to, must not run if the looper is restarted
+                completion->mAbandoned = true;
+                auto *pending = completion.get();
+                eraseEventLocked(
+                    [pending](const Event &event) { return event.mCompletion == pending; });
+                return NAME_NOT_FOUND;
+            }
+        }
+        mRepliesCondition.wait(_lock);
+    }
+    return OK;
+}
+
+void ALooper::postBroadcast(const std::shared_ptr<AMessage> &msg, int64_t delayUs,
+                            const std::shared_ptr<const HandlerList> &handlers) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    enqueueLocked(Event{whenUsLocked(delayUs), msg, ATask(), handlers});
+}
+
+int64_t ALooper::whenUsLocked(int64_t delayUs) {
+    auto nowUs = nowUsLocked();
+    if (delayUs <= 0) { return nowUs; }
+    return delayUs > INT64_MAX - nowUs ? INT64_MAX : nowUs + delayUs;
+}
+
+void ALooper::enqueueLocked(Event &&event) {
+    std::list<Event> node;
+    node.push_back(std::move(event));
+    enqueueLocked(&node);
+}
+
+void ALooper::enqueueLocked(std::list<Event> *node) {
+    const auto &event = node->front();
+
+    // most events are due after everything already queued, look for their place from the back
+    auto it = mEventQueue.end();
+    while (it != mEventQueue.begin() && std::prev(it)->mWhenUs > event.mWhenUs) { --it; }
+
+    if (it == mEventQueue.begin() || isReleasedByBarrierLocked(event)) { headChangedLocked(); }
+
+    accountEnqueuedLocked(event);
+    mEventQueue.splice(it, *node, node->begin());
+}
 
+void ALooper::setFairScheduling(bool enabled, int64_t quantumUs) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    mFairScheduling = enabled;
+    mFairQuantumUs = quantumUs > 0 ? quantumUs : 1;
+    wakeLocked();
+}
+
+status_t ALooper::setHandlerWeight(handler_id handlerId, uint32_t weight) {
+    if (weight == 0) { return BAD_VALUE; }
+
+    std::lock_guard<std::mutex> _lock(mLock);
+    if (weight == 1) {
+        mFairWeights.erase(handlerId);
+    } else {
+        mFairWeights[handlerId] = weight;
+    }
     return OK;
 }
 
-void ALooper::post(const std::shared_ptr<AMessage> &msg, int64_t delayUs) {
+std::list<ALooper::Event>::iterator ALooper::nextEventLocked() {
+    auto next = mEventQueue.begin();
+    if (next != mEventQueue.end() && next->mBarrierToken != 0) {
+        // stalled by a barrier, only asynchronous events go through
+        do {
+            ++next;
+        } while (next != mEventQueue.end() && !IsAsynchronous(*next));
+    }
+    return next;
+}
+
+// static
+ALooper::handler_id ALooper::FairKey(const Event &event) {
+    return event.mMessage != nullptr && event.mHandlers == nullptr ? event.mMessage->mTarget : 0;
+}
+
+void ALooper::promoteLocked(std::list<Event>::iterator it) {
+    auto key = FairKey(*it);
+    auto inserted = mFairQueues.emplace(key, FairQueue{{}, 0});
+    auto &queue = inserted.first->second;
+    // relinks the node, nothing is copied nor allocated
+    queue.mEvents.splice(queue.mEvents.end(), mEventQueue, it);
+    if (inserted.second) { mFairRound.push_back(key); }
+}
+
+void ALooper::chargeLocked() {
+    mFairChargePending = false;
+    // the queue may have gone with its handler meanwhile
+    if (mFairRound.empty() || mFairRound.front() != mFairChargeKey) { return; }
+
+    auto it = mFairQueues.find(mFairChargeKey);
+    it->second.mDeficitUs -= mFairChargeUs;
+    if (it->second.mEvents.empty()) {
+        // an idle handler does not save up credit
+        mFairQueues.erase(it);
+        mFairRound.pop_front();
+        mFairTurnStarted = false;
+    } else if (it->second.mDeficitUs <= 0) {
+        // turn over, an overrun is paid back on the next one
+        mFairRound.splice(mFairRound.end(), mFairRound, mFairRound.begin());
+        mFairTurnStarted = false;
+    }
+}
+
+void ALooper::takeFairLocked(std::list<Event> *into) {
+    auto key = mFairRound.front();
+    auto &queue = mFairQueues[key];
+    if (!mFairTurnStarted) {
+        auto weight = mFairWeights.find(key);
+        queue.mDeficitUs += mFairQuantumUs * (weight == mFairWeights.end() ? 1 : weight->second);
+        mFairTurnStarted = true;
+    }
+
+    into->splice(into->end(), queue.mEvents, queue.mEvents.begin());
+
+    mFairChargeKey = key;
+    mFairChargeUs = 0;
+    mFairChargePending = true;
+}
+
+void ALooper::dropFairQueueLocked(KeyedVector<handler_id, FairQueue>::iterator it) {
+    auto key = it->first;
+    if (mFairRound.front() == key) { mFairTurnStarted = false; }
+    mFairRound.remove(key);
+    mFairQueues.erase(it);
+}
+
+// static
+bool ALooper::IsAsynchronous(const Event &event) {
+    return event.mMessage != nullptr && event.mMessage->isAsynchronous();
+}
+
+bool ALooper::isReleasedByBarrierLocked(const Event &event) const {
+    // the looper may be blocked on a barrier with no asynchronous event to wait for
+    return !mEventQueue.empty() && mEventQueue.begin()->mBarrierToken != 0 &&
+           IsAsynchronous(event);
+}
+
+int32_t ALooper::postSyncBarrier() {
     std::lock_guard<std::mutex> _lock(mLock);
+    auto token = mNextBarrierToken++;
+
+    Event event{whenUsLocked(0)};
+    event.mBarrierToken = token;
+    enqueueLocked(std::move(event));
+    return token;
+}
+
+status_t ALooper::removeSyncBarrier(int32_t token) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    for (auto it = mEventQueue.begin(); it != mEventQueue.end(); ++it) {
+        if (it->mBarrierToken != token) { continue; }
+
+        // events held back by it are released
+        if (it == mEventQueue.begin()) { headChangedLocked(); }
+        accountDequeuedLocked(*it);
+        mEventQueue.erase(it);
+        return OK;
+    }
+    return NAME_NOT_FOUND;
+}
+
+// static
+std::size_t ALooper::EventBytes(const Event &event) {
+    // list node and event, plus the message it owns. broadcast messages are shared, but they are
+    // counted on every looper as they are kept alive by each of them
+    std::size_t bytes = sizeof(Event) + 2 * sizeof(void *);
+    if (event.mMessage != nullptr) { bytes += sizeof(AMessage); }
+    return bytes;
+}
+
+void ALooper::accountEnqueuedLocked(const Event &event) {
+    ++mStats.mQueueDepth;
+    mStats.mQueueBytes += EventBytes(event);
+    if (mStats.mQueueDepth > mStats.mMaxQueueDepth) { mStats.mMaxQueueDepth = mStats.mQueueDepth; }
+    if (mStats.mQueueBytes > mStats.mMaxQueueBytes) { mStats.mMaxQueueBytes = mStats.mQueueBytes; }
+}
 
-    int64_t whenUs;
-    if (delayUs > 0) {
-        auto nowUs = GetNowUs();
-        whenUs = (delayUs > INT64_MAX - nowUs ? INT64_MAX : nowUs + delayUs);
+void ALooper::accountDequeuedLocked(const Event &event) {
+    --mStats.mQueueDepth;
+    mStats.mQueueBytes -= EventBytes(event);
+}
+
+bool ALooper::runIdleHandlersLocked(std::unique_lock<std::mutex> &lock) {
+    if (mIdleHandlersRan || mIdleHandlers.empty()) { return false; }
+    mIdleHandlersRan = true;
+
+    mPendingIdleHandlers = mIdleHandlers;
+    lock.unlock();
+
+    for (auto &entry : mPendingIdleHandlers) {
+        beginDelivery(0, 0);
+        auto keep = (*entry.mHandler)();
+        endDelivery(nullptr);
+        // only the entries of handlers which asked to be unregistered are left set
+        if (keep) { entry.mHandler = nullptr; }
+    }
+
+    lock.lock();
+    for (const auto &entry : mPendingIdleHandlers) {
+        if (entry.mHandler == nullptr) { continue; }
+        for (auto it = mIdleHandlers.begin(); it != mIdleHandlers.end(); ++it) {
+            if (it->mId == entry.mId) {
+                mIdleHandlers.erase(it);
+                break;
+            }
+        }
+    }
+    mPendingIdleHandlers.clear();
+    return true;
+}
+
+void ALooper::expire(const Event &event, AHandler *retained) {
+    const auto &msg = event.mMessage;
+    if (event.mHandlers != nullptr) {
+        for (const auto &it : *event.mHandlers) {
+            std::shared_ptr<AHandler> handler = it.lock();
+            if (handler != nullptr) { handler->expireMessage(msg); }
+        }
+    } else if (retained != nullptr) {
+        retained->expireMessage(msg);
     } else {
-        whenUs = GetNowUs();
+        std::shared_ptr<AHandler> handler = msg->mHandler.lock();
+        if (handler != nullptr) { handler->expireMessage(msg); }
     }
 
-    auto it = mEventQueue.begin();
-    while (it != mEventQueue.end() && (*it).mWhenUs <= whenUs) { ++it; }
+    // unless the handler replied on its own
+    std::shared_ptr<AReplyToken> replyToken;
+    if (msg->senderAwaitsResponse(&replyToken)) {
+        auto reply = std::make_shared<AMessage>();
+        reply->setInt32("err", TIMED_OUT);
+        reply->postReply(replyToken);
+    }
+}
 
-    Event event{whenUs, msg};
-    if (it == mEventQueue.begin()) { mQueueChangedCondition.notify_one(); }
+void ALooper::publishDelivery(handler_id handlerId, uint32_t what, int64_t startUs) {
+    // plain stores around fences, no read-modify-write on the delivery path
+    auto seq = mDeliverySeq.load(std::memory_order_relaxed);
+    mDeliverySeq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    mDeliveryHandlerId.store(handlerId, std::memory_order_relaxed);
+    mDeliveryWhat.store(what, std::memory_order_relaxed);
+    mDeliveryStartUs.store(startUs, std::memory_order_relaxed);
+    mDeliverySeq.store(seq + 2, std::memory_order_release);
+}
 
-    mEventQueue.insert(it, event);
+void ALooper::beginDelivery(handler_id handlerId, uint32_t what) {
+    publishDelivery(handlerId, what, GetNowUs());
+}
+
+int64_t ALooper::endDelivery(AHandler *handler) {
+    auto elapsedUs = GetNowUs() - mDeliveryStartUs.load(std::memory_order_relaxed);
+    publishDelivery(0, 0, 0);
+
+    // single writer, no need for a read-modify-write
+    mBusyUs.store(mBusyUs.load(std::memory_order_relaxed) + elapsedUs, std::memory_order_relaxed);
+    if (handler != nullptr) {
+        handler->mBusyUs.store(handler->mBusyUs.load(std::memory_order_relaxed) + elapsedUs,
+                               std::memory_order_relaxed);
+    }
+    return elapsedUs;
+}
+
+int64_t ALooper::resumeDelivery(const Delivery &delivery, AHandler *handler) {
+    // the looper is already accounted for by the outer delivery
+    auto elapsedUs = GetNowUs() - mDeliveryStartUs.load(std::memory_order_relaxed);
+    handler->mBusyUs.store(handler->mBusyUs.load(std::memory_order_relaxed) + elapsedUs,
+                           std::memory_order_relaxed);
+
+    publishDelivery(delivery.mHandlerId, delivery.mWhat, delivery.mStartUs);
+    return elapsedUs;
+}
+
+void ALooper::headChangedLocked() {
+    // keep a manual clock from moving until the looper has re-evaluated its queue
+    if (mClock != nullptr && isRunningLocked()) { mClock->onBusy(this); }
+    wakeLocked();
 }
 
 bool ALooper::loop() {
-    Event event;
+    // the event being delivered, spliced out of its queue so that a periodic message goes back
+    // in without allocating
+    std::list<Event> current;
+    bool expired;
+    bool migrated;
+    bool fair;
+    std::shared_ptr<ALooper> forwardTo;
+    // the target of the message, if retained, which needs no reference
+    AHandler *retained = nullptr;
     {
         std::unique_lock<std::mutex> _lock(mLock);
         if (mThread == nullptr && !mRunningLocally) {
-            LOG("expect to run in an independent thread but remote thread is null");
+            // this is how stop() ends the loop, anything else is unexpected
+            if (!mStopped) {
+                LOG("expect to run in an independent thread but remote thread is null");
+            }
             return false;
         }
 
-        if (mEventQueue.empty()) {
-            mQueueChangedCondition.wait(_lock);
+        if (mFairChargePending) { chargeLocked(); }
+
+        // a looper which always has something due would otherwise never see its fds
+        if (mEpollFd >= 0 && mDeliveriesSinceFdPoll >= kDeliveriesPerFdPoll) {
+            pollFdsLocked(_lock, 0);
+        }
+
+        auto next = nextEventLocked();
+        auto nowUs = nowUsLocked();
+        if (mFairScheduling) {
+            while (next != mEventQueue.end() && next->mWhenUs <= nowUs) {
+                promoteLocked(next);
+                next = nextEventLocked();
+            }
+        }
+
+        // ready queues are drained even after fair scheduling has been turned off
+        fair = !mFairRound.empty();
+        if (!fair && (next == mEventQueue.end() || next->mWhenUs > nowUs)) {
+            // housekeeping first, it may well post something which is due right away
+            if (runIdleHandlersLocked(_lock)) { return true; }
+
+            // sleep until the latest acceptable time for the next event, everything becoming due
+            // in the meantime is then delivered without blocking again
+            auto deadlineUs = INT64_MAX;
+            if (next != mEventQueue.end()) {
+                auto whenUs = next->mWhenUs;
+                deadlineUs = (whenUs > INT64_MAX - mTimerSlackUs ? INT64_MAX
+                                                                 : whenUs + mTimerSlackUs);
+            }
+
+            if (mClock != nullptr && mClock->isManual()) {
+                // virtual time only moves once every looper of the clock is idle
+                if (!reportIdleLocked(_lock, deadlineUs)) { waitLocked(_lock, -1); }
+            } else if (deadlineUs == INT64_MAX) {
+                waitLocked(_lock, -1);
+            } else if (waitLocked(_lock, deadlineUs - nowUs)) {
+                ++mStats.mTimedWakeups;
+            }
             return true;
         }
-        auto whenUs = mEventQueue.begin()->mWhenUs;
-        auto nowUs = GetNowUs();
 
-        if (whenUs > nowUs) {
-            auto delayUs = whenUs - nowUs;
-            if (delayUs > INT64_MAX / 1000) { delayUs = INT64_MAX / 1000; }
-            mQueueChangedCondition.wait_for(_lock, delayUs * 1us);
+        if (fair) {
+            takeFairLocked(&current);
+        } else {
+            current.splice(current.end(), mEventQueue, next);
+        }
+        const auto &event = current.front();
+        accountDequeuedLocked(event);
+        ++mDeliveriesSinceFdPoll;
+        if (event.mFdSeq != 0) {
+            // delivered right below, the fd can be reported again from the next poll on
+            auto it = mFdRequests.find(event.mFd);
+            if (it != mFdRequests.end() && it->second.mSeq == event.mFdSeq) {
+                it->second.mPending = false;
+            }
+        }
+        mIdleHandlersRan = false;
+
+        // queued here for a handler which migrated since, e.g. a periodic message
+        migrated = !mMigrated.empty();
+        if (migrated && event.mMessage != nullptr && event.mHandlers == nullptr) {
+            forwardTo = migratedToLocked(event.mMessage->mTarget);
+        }
+
+        if (!mRetained.empty() && forwardTo == nullptr && event.mMessage != nullptr &&
+            event.mHandlers == nullptr) {
+            auto it = mRetained.find(event.mMessage->mTarget);
+            if (it != mRetained.end()) { retained = it->second.get(); }
+        }
+
+        expired = forwardTo == nullptr && event.mMessage != nullptr &&
+                  event.mMessage->mExpiryUs < nowUs;
+        if (expired) {
+            ++mStats.mExpired;
+        } else if (forwardTo == nullptr) {
+            ++mStats.mDelivered;
+        }
+    }
+
+    auto &event = current.front();
+    bool periodic = event.mPeriodicToken != 0;
+
+    if (forwardTo != nullptr) {
+        event.mMessage->mLooper = forwardTo;
+        if (periodic) {
+            forwardTo->post(event.mMessage, 0);
+            reschedulePeriodic(&current);
+        } else {
+            forwardTo->post(std::move(event.mMessage), 0);
+        }
+        return true;
+    }
+
+    if (expired) {
+        expire(event, retained);
+        if (periodic) { reschedulePeriodic(&current); }
+        return true;
+    }
+
+    int64_t elapsedUs = 0;
+    if (event.mHandlers != nullptr) {
+        for (const auto &it : *event.mHandlers) {
+            std::shared_ptr<AHandler> handler = it.lock();
+            if (handler == nullptr) { continue; }
+            if (migrated) {
+                // the handler moved since the broadcast was queued, follow it
+                std::shared_ptr<ALooper> looper = handler->looper();
+                if (looper.get() != this) {
+                    if (looper != nullptr) {
+                        looper->postBroadcast(event.mMessage, 0,
+                                              std::make_shared<const HandlerList>(1, it));
+                    }
+                    continue;
+                }
+            }
+            beginDelivery(handler->id(), event.mMessage->what());
+            handler->deliverMessage(event.mMessage);
+            elapsedUs += endDelivery(handler.get());
+        }
+    } else if (event.mMessage != nullptr) {
+        auto *target = retained;
+        std::shared_ptr<AHandler> handler;
+        if (target == nullptr) {
+            handler = event.mMessage->mHandler.lock();
+            target = handler.get();
+        }
+        if (target == nullptr) {
+            LOG("W : failed to deliver message as target handler %d is gone",
+                event.mMessage->mTarget);
+            if (periodic) { cancelPeriodic(event.mPeriodicToken); }
             return true;
         }
+        beginDelivery(event.mMessage->mTarget, event.mMessage->what());
+        target->deliverMessage(event.mMessage);
+        elapsedUs = endDelivery(target);
+        if (periodic) { reschedulePeriodic(&current); }
+    } else {
+        beginDelivery(0, 0);
+        event.mTask();
+        elapsedUs = endDelivery(nullptr);
+    }
+
+    // only the looper thread touches the charge, no need for the lock
+    if (fair) { mFairChargeUs = elapsedUs; }
+    return true;
+}
+
+bool ALooper::waitLocked(std::unique_lock<std::mutex> &lock, int64_t timeoutUs) {
+    // std::condition_variable converts the timeout into an absolute steady_clock time_point,
+    // keep it far enough from the limits to not overflow
+    static constexpr int64_t kMaxWaitUs = INT64_MAX / 1000 / 2;
+
+    bool timedOut = false;
+#ifdef __linux__
+    if (mEpollFd >= 0) {
+        // round up, waking before the deadline would only cost another wait
+        int timeoutMs = -1;
+        if (timeoutUs >= 0) {
+            timeoutMs = (timeoutUs > (int64_t)INT_MAX * 1000 ? INT_MAX : (timeoutUs + 999) / 1000);
+        }
 
-        event = *mEventQueue.begin();
-        mEventQueue.erase(mEventQueue.begin());
+        timedOut = pollFdsLocked(lock, timeoutMs) == 0;
+        ++mStats.mWakeups;
+        return timedOut;
     }
+#endif  // __linux__
+
+    if (timeoutUs < 0 || timeoutUs > kMaxWaitUs) {
+        mQueueChangedCondition.wait(lock);
+    } else {
+        timedOut = mQueueChangedCondition.wait_for(lock, timeoutUs * 1us) ==
+                   std::cv_status::timeout;
+    }
+    ++mStats.mWakeups;
+    return timedOut;
+}
+
+int ALooper::pollFdsLocked(std::unique_lock<std::mutex> &lock, int timeoutMs) {
+#ifdef __linux__
+    static constexpr int kMaxEpollEvents = 16;
+
+    mDeliveriesSinceFdPoll = 0;
+
+    epoll_event events[kMaxEpollEvents];
+    int numEvents;
+    if (timeoutMs == 0) {
+        numEvents = epoll_wait(mEpollFd, events, kMaxEpollEvents, 0);
+    } else {
+        lock.unlock();
+        numEvents = epoll_wait(mEpollFd, events, kMaxEpollEvents, timeoutMs);
+        lock.lock();
+    }
+    if (numEvents < 0 && errno != EINTR) { LOG("E : epoll_wait failed, errno %d", errno); }
+
+    auto nowUs = nowUsLocked();
+    for (int i = 0; i < numEvents; ++i) {
+        auto fd = (int)(events[i].data.u64 & UINT32_MAX);
+        auto seq = (uint32_t)(events[i].data.u64 >> 32);
+        if (fd == mWakeFd) {
+            eventfd_t value;
+            eventfd_read(mWakeFd, &value);
+            continue;
+        }
 
-    event.mMessage->deliver();
+        auto it = mFdRequests.find(fd);
+        if (it == mFdRequests.end() || it->second.mSeq != seq) { continue; }  // removed
+        // level-triggered, not read yet by the handler, which would block on a second read
+        if (it->second.mPending) { continue; }
+
+        std::shared_ptr<AHandler> handler = it->second.mHandler.lock();
+        if (handler == nullptr) {
+            // unwatch it, a level-triggered fd left ready would wake us up forever
+            LOG("W : unwatching fd %d as its handler is gone", fd);
+            mFdRequests.erase(it);
+            if (epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, nullptr) < 0 && errno != EBADF) {
+                LOG("W : failed to unwatch fd %d, errno %d", fd, errno);
+            }
+            continue;
+        }
+
+        int readyEvents = 0;
+        if (events[i].events & EPOLLIN) { readyEvents |= EVENT_INPUT; }
+        if (events[i].events & EPOLLOUT) { readyEvents |= EVENT_OUTPUT; }
+        if (events[i].events & EPOLLERR) { readyEvents |= EVENT_ERROR; }
+        if (events[i].events & EPOLLHUP) { readyEvents |= EVENT_HANGUP; }
+
+        auto msg = std::make_shared<AMessage>(it->second.mWhat, handler);
+        msg->setInt32("fd", fd);
+        msg->setInt32("events", readyEvents);
+        // I/O is not held back by synchronization barriers
+        msg->setAsynchronous(true);
+        Event event{nowUs, msg};
+        event.mFdSeq = seq;
+        event.mFd = fd;
+        it->second.mPending = true;
+        enqueueLocked(std::move(event));
+    }
+    return numEvents;
+#else
+    return 0;
+#endif  // __linux__
+}
+
+void ALooper::wakeLocked() {
+#ifdef __linux__
+    if (mWakeFd >= 0) {
+        eventfd_write(mWakeFd, 1);
+        return;
+    }
+#endif  // __linux__
+    mQueueChangedCondition.notify_one();
+}
+
+bool ALooper::isCurrentThread() const { return sCurrentLooper == this; }
+
+void ALooper::wake() {
+    std::lock_guard<std::mutex> _lock(mLock);
+    wakeLocked();
+}
+
+void ALooper::setBlocked(bool blocked) {
+    std::unique_lock<std::mutex> _lock(mLock);
+    if (mClock == nullptr || !mClock->isManual()) { return; }
+
+    if (blocked) {
+        reportIdleLocked(_lock, INT64_MAX);
+    } else {
+        mClock->onBusy(this);
+    }
+}
+
+bool ALooper::reportIdleLocked(std::unique_lock<std::mutex> &lock, int64_t deadlineUs) {
+    auto loopers = mClock->onIdle(this, deadlineUs);
+    if (loopers.empty()) { return false; }
+
+    lock.unlock();
+    for (const auto &looper : loopers) {
+        if (looper.get() != this) { looper->wake(); }
+    }
+    loopers.clear();
+    lock.lock();
     return true;
 }
 
+status_t ALooper::enableFdEventsLocked() {
+#ifdef __linux__
+    if (mEpollFd >= 0) { return OK; }
+
+    mWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mWakeFd < 0) {
+        LOG("E : failed to create wake eventfd, errno %d", errno);
+        return UNKNOWN_ERROR;
+    }
+
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        LOG("E : failed to create epoll instance, errno %d", errno);
+        close(mWakeFd);
+        mWakeFd = -1;
+        return UNKNOWN_ERROR;
+    }
+
+    epoll_event item{};
+    item.events = EPOLLIN;
+    item.data.u64 = (uint32_t)mWakeFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, mWakeFd, &item) < 0) {
+        LOG("E : failed to watch wake eventfd, errno %d", errno);
+        close(epollFd);
+        close(mWakeFd);
+        mWakeFd = -1;
+        return UNKNOWN_ERROR;
+    }
+
+    // a looper thread currently blocked on the condition variable re-enters its wait on epoll
+    mEpollFd = epollFd;
+    mQueueChangedCondition.notify_one();
+    return OK;
+#else
+    return INVALID_OPERATION;
+#endif  // __linux__
+}
+
+status_t ALooper::addFd(int fd, int events, const std::shared_ptr<AHandler> &handler,
+                        uint32_t what) {
+#ifdef __linux__
+    if (fd < 0 || handler == nullptr) { return BAD_VALUE; }
+
+    std::lock_guard<std::mutex> _lock(mLock);
+    return addFdLocked(fd, events, handler, what);
+#else
+    return INVALID_OPERATION;
+#endif  // __linux__
+}
+
+status_t ALooper::addFdLocked(int fd, int events, const std::shared_ptr<AHandler> &handler,
+                              uint32_t what) {
+#ifdef __linux__
+    auto err = enableFdEventsLocked();
+    if (err != OK) { return err; }
+
+    // zero marks events which do not come from an fd
+    if (++mNextFdSeq == 0) { ++mNextFdSeq; }
+    FdRequest request{mNextFdSeq, events, what, handler};
+
+    epoll_event item{};
+    if (events & EVENT_INPUT) { item.events |= EPOLLIN; }
+    if (events & EVENT_OUTPUT) { item.events |= EPOLLOUT; }
+    item.data.u64 = ((uint64_t)request.mSeq << 32) | (uint32_t)fd;
+
+    auto op = (mFdRequests.find(fd) == mFdRequests.end() ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+    auto result = epoll_ctl(mEpollFd, op, fd, &item);
+    if (result < 0 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+        // closed without removeFd() which dropped it from the epoll set, this is a new file
+        // which reuses its number
+        result = epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &item);
+    }
+    if (result < 0) {
+        LOG("E : failed to watch fd %d, errno %d", fd, errno);
+        return BAD_VALUE;
+    }
+
+    mFdRequests[fd] = request;
+    return OK;
+#else
+    return INVALID_OPERATION;
+#endif  // __linux__
+}
+
+status_t ALooper::removeFd(int fd) {
+#ifdef __linux__
+    std::lock_guard<std::mutex> _lock(mLock);
+    auto it = mFdRequests.find(fd);
+    if (it == mFdRequests.end()) { return NAME_NOT_FOUND; }
+
+    mFdRequests.erase(it);
+    // the fd may already be closed, which removed it from the epoll set
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, nullptr) < 0 && errno != EBADF) {
+        LOG("W : failed to unwatch fd %d, errno %d", fd, errno);
+    }
+    return OK;
+#else
+    return INVALID_OPERATION;
+#endif  // __linux__
+}
+
 // to be called by AMessage::postAndAwaitResponse only
 std::shared_ptr<AReplyToken> ALooper::createReplyToken() {
     return std::make_shared<AReplyToken>(shared_from_this());
@@ -194,6 +1405,7 @@ std::shared_ptr<AReplyToken> ALooper::createReplyToken() {
 status_t ALooper::awaitResponse(const std::shared_ptr<AReplyToken> &replyToken,
                                 std::shared_ptr<AMessage> *response) {
     // return status in case we want to handle an interrupted wait
+    BlockedCall blocked;
     std::unique_lock<std::mutex> _lock(mRepliesLock);
     assert(replyToken != nullptr);
     while (!replyToken->retrieveReply(response)) {
@@ -206,6 +1418,71 @@ status_t ALooper::awaitResponse(const std::shared_ptr<AReplyToken> &replyToken,
     return OK;
 }
 
+// to be called by AMessage::postAndAwaitResponse only
+status_t ALooper::deliverAndTakeResponse(const std::shared_ptr<AMessage> &msg,
+                                         const std::shared_ptr<AReplyToken> &replyToken,
+                                         std::shared_ptr<AMessage> *response) {
+    assert(isCurrentThread());
+    std::shared_ptr<AHandler> handler = msg->mHandler.lock();
+    if (handler == nullptr) {
+        LOG("W : failed to deliver message as target handler %d is gone", msg->mTarget);
+        return NAME_NOT_FOUND;
+    }
+
+    bool expired;
+    std::shared_ptr<ALooper> target;
+    {
+        std::lock_guard<std::mutex> _lock(mLock);
+        target = migratedToLocked(msg->mTarget);
+    }
+    if (target != nullptr) {
+        // the handler runs on another thread now, which can be waited for
+        msg->mLooper = target;
+        target->post(msg, 0);
+        return awaitResponse(replyToken, response);
+    }
+
+    std::shared_ptr<ARecorder> recorder;
+    {
+        std::lock_guard<std::mutex> _lock(mLock);
+        auto nowUs = nowUsLocked();
+        if (mRecorder != nullptr) {
+            recorder = mRecorder;
+            sRecords.clear();
+            ARecorder::Encode(nowUs, 0, msg->mTarget, *msg, &sRecords);
+        }
+        expired = msg->mExpiryUs < nowUs;
+        if (expired) {
+            ++mStats.mExpired;
+        } else {
+            ++mStats.mDelivered;
+        }
+    }
+    if (recorder != nullptr) { recorder->write(sRecords, 1); }
+
+    if (expired) {
+        expire(Event{0, msg});
+    } else {
+        // nested in the delivery of the sender, if any
+        auto outer = getCurrentDelivery();
+        beginDelivery(handler->id(), msg->what());
+        handler->deliverMessage(msg);
+        if (outer.mStartUs != 0) {
+            resumeDelivery(outer, handler.get());
+        } else {
+            endDelivery(handler.get());
+        }
+    }
+
+    std::lock_guard<std::mutex> _lock(mRepliesLock);
+    if (!replyToken->retrieveReply(response)) {
+        LOG("E : handler %d did not reply to what %u synchronously, as required from its own "
+            "looper thread", msg->mTarget, msg->what());
+        return WOULD_BLOCK;
+    }
+    return OK;
+}
+
 status_t ALooper::postReply(const std::shared_ptr<AReplyToken> &replyToken,
                             const std::shared_ptr<AMessage> &reply) {
     std::lock_guard<std::mutex> _lock(mRepliesLock);
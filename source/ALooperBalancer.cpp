@@ -0,0 +1,164 @@
+#define TAG "ALooperBalancer"
+
+#include <AHandler.h>
+#include <ALooperBalancer.h>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace diordna {
+
+ALooperBalancer::ALooperBalancer(int64_t intervalUs, double threshold)
+    : mIntervalUs(intervalUs > 0 ? intervalUs : 1),
+      mThreshold(threshold),
+      mMigrations(0),
+      mRunning(false) {}
+
+ALooperBalancer::~ALooperBalancer() { stop(); }
+
+status_t ALooperBalancer::addLooper(const std::shared_ptr<ALooper> &looper) {
+    if (looper == nullptr) { return BAD_VALUE; }
+
+    std::lock_guard<std::mutex> _lock(mLock);
+    for (const auto &it : mLoopers) {
+        if (it.mLooper.lock() == looper) { return ALREADY_EXISTS; }
+    }
+    mLoopers.push_back(LooperState{looper, looper->getStats().mBusyUs, 0});
+    return OK;
+}
+
+status_t ALooperBalancer::removeLooper(const std::shared_ptr<ALooper> &looper) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    for (auto it = mLoopers.begin(); it != mLoopers.end(); ++it) {
+        if (it->mLooper.lock() == looper) {
+            mLoopers.erase(it);
+            return OK;
+        }
+    }
+    return NAME_NOT_FOUND;
+}
+
+status_t ALooperBalancer::addHandler(const std::shared_ptr<AHandler> &handler) {
+    if (handler == nullptr) { return BAD_VALUE; }
+
+    std::lock_guard<std::mutex> _lock(mLock);
+    for (const auto &it : mHandlers) {
+        if (it.mHandler.lock() == handler) { return ALREADY_EXISTS; }
+    }
+    mHandlers.push_back(HandlerState{handler, handler->busyUs(), 0});
+    return OK;
+}
+
+status_t ALooperBalancer::removeHandler(const std::shared_ptr<AHandler> &handler) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    for (auto it = mHandlers.begin(); it != mHandlers.end(); ++it) {
+        if (it->mHandler.lock() == handler) {
+            mHandlers.erase(it);
+            return OK;
+        }
+    }
+    return NAME_NOT_FOUND;
+}
+
+uint32_t ALooperBalancer::migrationCount() {
+    std::lock_guard<std::mutex> _lock(mLock);
+    return mMigrations;
+}
+
+status_t ALooperBalancer::start() {
+    std::lock_guard<std::mutex> _lock(mLock);
+    if (mRunning) { return INVALID_OPERATION; }
+    mRunning = true;
+    mThread = std::thread([this]() { threadLoop(); });
+    return OK;
+}
+
+status_t ALooperBalancer::stop() {
+    {
+        std::lock_guard<std::mutex> _lock(mLock);
+        if (!mRunning) { return INVALID_OPERATION; }
+        mRunning = false;
+        mCondition.notify_all();
+    }
+    mThread.join();
+    return OK;
+}
+
+void ALooperBalancer::threadLoop() {
+    std::unique_lock<std::mutex> _lock(mLock);
+    auto lastUs = ALooper::GetNowUs();
+    while (mRunning) {
+        mCondition.wait_for(_lock, std::chrono::microseconds(mIntervalUs));
+        if (!mRunning) { break; }
+
+        auto nowUs = ALooper::GetNowUs();
+        std::shared_ptr<AHandler> handler;
+        std::shared_ptr<ALooper> from;
+        std::shared_ptr<ALooper> to;
+        bool migrate = sampleLocked(nowUs - lastUs, &handler, &from, &to);
+        lastUs = nowUs;
+        if (!migrate) { continue; }
+
+        // the migration waits for the source looper, which must not wait for us
+        _lock.unlock();
+        auto err = from->migrateHandler(handler, to);
+        _lock.lock();
+        if (err == OK) { ++mMigrations; }
+    }
+}
+
+bool ALooperBalancer::sampleLocked(int64_t elapsedUs, std::shared_ptr<AHandler> *handler,
+                                   std::shared_ptr<ALooper> *from, std::shared_ptr<ALooper> *to) {
+    LooperState *busiest = nullptr;
+    LooperState *idlest = nullptr;
+    for (auto it = mLoopers.begin(); it != mLoopers.end();) {
+        std::shared_ptr<ALooper> looper = it->mLooper.lock();
+        if (looper == nullptr) {
+            it = mLoopers.erase(it);
+            continue;
+        }
+        auto busyUs = looper->getStats().mBusyUs;
+        it->mBusyUs = busyUs - it->mLastBusyUs;
+        it->mLastBusyUs = busyUs;
+        ++it;
+    }
+    for (auto &it : mLoopers) {
+        if (busiest == nullptr || it.mBusyUs > busiest->mBusyUs) { busiest = &it; }
+        if (idlest == nullptr || it.mBusyUs < idlest->mBusyUs) { idlest = &it; }
+    }
+
+    for (auto it = mHandlers.begin(); it != mHandlers.end();) {
+        std::shared_ptr<AHandler> h = it->mHandler.lock();
+        if (h == nullptr) {
+            it = mHandlers.erase(it);
+            continue;
+        }
+        auto busyUs = h->busyUs();
+        it->mBusyUs = busyUs - it->mLastBusyUs;
+        it->mLastBusyUs = busyUs;
+        ++it;
+    }
+
+    if (busiest == nullptr || busiest == idlest) { return false; }
+    auto gapUs = busiest->mBusyUs - idlest->mBusyUs;
+    if (gapUs <= mThreshold * elapsedUs) { return false; }
+
+    *from = busiest->mLooper.lock();
+    *to = idlest->mLooper.lock();
+    HandlerState *candidate = nullptr;
+    for (auto &it : mHandlers) {
+        if (it.mBusyUs <= 0 || it.mBusyUs > gapUs / 2) { continue; }
+        std::shared_ptr<AHandler> h = it.mHandler.lock();
+        if (h == nullptr || h->looper() != *from) { continue; }
+        if (candidate == nullptr || it.mBusyUs > candidate->mBusyUs) { candidate = &it; }
+    }
+    if (candidate == nullptr) { return false; }
+
+    *handler = candidate->mHandler.lock();
+    return *handler != nullptr && *from != nullptr && *to != nullptr;
+}
+
+}  // namespace diordna
\ No newline at end of file
@@ -4,9 +4,10 @@
 #include <ALooperRoster.h>
 #include <AMessage.h>
 
+#include <algorithm>
+#include <cassert>
 #include <string>
 #include <vector>
-#include <cassert>
 
 namespace diordna {
 
@@ -50,26 +51,70 @@ void ALooperRoster::unregisterStaleHandlers() {
     {
         std::lock_guard<std::mutex> _lock(mLock);
 
-        for (auto it = mHandlers.begin(); it != mHandlers.end(); ++it) {
+        for (auto it = mHandlers.begin(); it != mHandlers.end();) {
             const auto &info = it->second;
             std::shared_ptr<ALooper> looper = info.mLooper.lock();
             if (looper == nullptr) {
                 LOG("Unregistering stale handler %d", it->first);
                 it = mHandlers.erase(it);
-                std::advance(it, 1);
             } else {
                 // At this point 'looper' might be the only sp<> keeping the object alive. To
                 // prevent it from going out of scope and having ~ALooper call this method again
                 // recursively and then deadlocking because of the Autolock above, add it to a
                 // Vector which will go out of scope after the lock has been released.
                 activeLoopers.push_back(looper);
+                ++it;
             }
         }
     }
 }
 
+void ALooperRoster::moveHandler(ALooper::handler_id handlerId,
+                                const std::shared_ptr<ALooper> &looper) {
+    std::lock_guard<std::mutex> _lock(mLock);
+
+    auto it = mHandlers.find(handlerId);
+    if (it != mHandlers.end()) { it->second.mLooper = looper; }
+}
+
+std::shared_ptr<AHandler> ALooperRoster::findHandler(ALooper::handler_id handlerId) {
+    std::lock_guard<std::mutex> _lock(mLock);
+
+    auto it = mHandlers.find(handlerId);
+    if (it == mHandlers.end()) { return nullptr; }
+    return it->second.mHandler.lock();
+}
+
 void ALooperRoster::dump(int fd, const std::vector<std::string> &args) {
-    // TODO: pass
+    std::vector<std::shared_ptr<ALooper>> loopers;
+    std::vector<std::pair<ALooper::handler_id, std::shared_ptr<AHandler>>> handlers;
+    {
+        std::lock_guard<std::mutex> _lock(mLock);
+        for (const auto &it : mHandlers) {
+            std::shared_ptr<ALooper> looper = it.second.mLooper.lock();
+            std::shared_ptr<AHandler> handler = it.second.mHandler.lock();
+            if (looper == nullptr || handler == nullptr) { continue; }
+            if (std::find(loopers.begin(), loopers.end(), looper) == loopers.end()) {
+                loopers.push_back(looper);
+            }
+            handlers.emplace_back(it.first, handler);
+        }
+    }
+    std::sort(handlers.begin(), handlers.end(),
+              [](const std::pair<ALooper::handler_id, std::shared_ptr<AHandler>> &a,
+                 const std::pair<ALooper::handler_id, std::shared_ptr<AHandler>> &b) {
+                  return a.first < b.first;
+              });
+
+    // the loopers dump themselves without our lock held, see unregisterStaleHandlers
+    for (const auto &looper : loopers) {
+        looper->dump(fd);
+        for (const auto &it : handlers) {
+            if (it.second->looper() != looper) { continue; }
+            dprintf(fd, "  handler %d: %u messages, %u expired\n", it.first,
+                    it.second->messageCount(), it.second->expiredCount());
+        }
+    }
 }
 
 }  // namespace diordna
\ No newline at end of file
@@ -23,10 +23,20 @@ status_t AReplyToken::setReply(const std::shared_ptr<AMessage> &reply) {
     return OK;
 }
 
-AMessage::AMessage() : mWhat(0), mTarget(0), mNumItems(0) {}
+AMessage::AMessage()
+    : mWhat(0),
+      mPayloadTag(nullptr),
+      mTarget(0),
+      mAsynchronous(false),
+      mExpiryUs(INT64_MAX),
+      mNumItems(0) {}
 
 AMessage::AMessage(uint32_t what, const std::shared_ptr<const AHandler> &handler)
-    : mWhat(what), mNumItems(0) {
+    : mWhat(what),
+      mPayloadTag(nullptr),
+      mAsynchronous(false),
+      mExpiryUs(INT64_MAX),
+      mNumItems(0) {
     setTarget(handler);
 }
 
@@ -47,6 +57,14 @@ void AMessage::setTarget(const std::shared_ptr<const AHandler> &handler) {
     }
 }
 
+void AMessage::setAsynchronous(bool async) { mAsynchronous = async; }
+
+bool AMessage::isAsynchronous() const { return mAsynchronous; }
+
+void AMessage::setExpiryUs(int64_t deadlineUs) { mExpiryUs = deadlineUs; }
+
+int64_t AMessage::expiryUs() const { return mExpiryUs; }
+
 void AMessage::clear() {
     for (auto i = 0; i < mNumItems; ++i) {
         auto *item = &mItems[i];
@@ -58,14 +76,8 @@ void AMessage::clear() {
 }
 
 void AMessage::freeItemValue(Item *item) {
-    switch (item->mType) {
-        case kTypeString: {
-            delete item->u.stringValue;
-            break;
-        }
-        // TODO: case kTypeOthers: extendable
-        default: break;
-    }
+    // strings, objects and arrays are owned by mObj, possibly shared with duplicates
+    item->mObj = nullptr;
     item->mType = kTypeNone;
 }
 
@@ -117,6 +129,17 @@ bool AMessage::contains(const char *name) const {
     return i < mNumItems;
 }
 
+std::size_t AMessage::countEntries() const { return mNumItems; }
+
+const char *AMessage::getEntryNameAt(std::size_t index, Type *type) const {
+    if (index >= mNumItems) {
+        *type = kTypeNone;
+        return nullptr;
+    }
+    *type = mItems[index].mType;
+    return mItems[index].mName;
+}
+
 #define BASIC_TYPE_SET_FIND(NAME, FIELD, TYPE)                       \
     void AMessage::set##NAME(const char *name, TYPE value) {         \
         auto *item = allocateItem(name);                             \
@@ -135,30 +158,68 @@ bool AMessage::contains(const char *name) const {
 
 BASIC_TYPE_SET_FIND(Int32, int32Value, int32_t)
 BASIC_TYPE_SET_FIND(Int64, int64Value, int64_t)
-// BASIC_TYPE_SET_FIND(Size, sizeValue, std::size_t)
-// BASIC_TYPE_SET_FIND(Float, floatValue, float)
-// BASIC_TYPE_SET_FIND(Double, doubleValue, double)
+BASIC_TYPE_SET_FIND(Size, sizeValue, std::size_t)
+BASIC_TYPE_SET_FIND(Float, floatValue, float)
+BASIC_TYPE_SET_FIND(Double, doubleValue, double)
 // Extendable
 
 #undef BASIC_TYPE_SET_FIND
 
-void AMessage::setString(const char *name, const char *s) {
+void AMessage::setString(const char *name, const char *s) { setString(name, std::string{s}); }
+
+void AMessage::setString(const char *name, const std::string &s) {
     auto *item = allocateItem(name);
+    auto str = std::make_shared<std::string>(s);
     item->mType = kTypeString;
-    item->u.stringValue = s;
+    item->u.stringValue = str->c_str();
+    item->mObj = str;
 }
 
-void AMessage::setString(const char *name, const std::string &s) { setString(name, s.c_str()); }
-
 bool AMessage::findString(const char *name, std::string *value) const {
     const auto *item = findItem(name, kTypeString);
     if (item != nullptr) {
-        *value = *item->u.stringValue;
+        *value = *static_cast<const std::string *>(item->mObj.get());
         return true;
     }
     return false;
 }
 
+void AMessage::setArray(const char *name, Type type, const void *data, std::size_t bytes,
+                        std::size_t count) {
+    // over-allocate and share ownership of the block through the aligned pointer
+    std::shared_ptr<uint8_t> block(new uint8_t[bytes + kArrayAlignment - 1],
+                                   std::default_delete<uint8_t[]>());
+    auto address = reinterpret_cast<std::uintptr_t>(block.get());
+    auto *aligned = block.get() + ((kArrayAlignment - address % kArrayAlignment) % kArrayAlignment);
+    if (bytes > 0) { std::memcpy(aligned, data, bytes); }
+
+    auto *item = allocateItem(name);
+    item->mType = type;
+    item->u.sizeValue = count;
+    item->mObj = std::shared_ptr<void>(block, aligned);
+}
+
+#define ARRAY_TYPE_SET_FIND(NAME, TYPE)                                                      \
+    void AMessage::set##NAME##Array(const char *name, const TYPE *data, std::size_t count) { \
+        setArray(name, kType##NAME##Array, data, count * sizeof(TYPE), count);               \
+    }                                                                                        \
+                                                                                             \
+    bool AMessage::find##NAME##Array(const char *name, ASpan<TYPE> *span) const {            \
+        const auto *item = findItem(name, kType##NAME##Array);                               \
+        if (item) {                                                                          \
+            *span = ASpan<TYPE>(static_cast<const TYPE *>(item->mObj.get()),                 \
+                                item->u.sizeValue);                                          \
+            return true;                                                                     \
+        }                                                                                    \
+        return false;                                                                        \
+    }
+
+ARRAY_TYPE_SET_FIND(Int32, int32_t)
+ARRAY_TYPE_SET_FIND(Int64, int64_t)
+ARRAY_TYPE_SET_FIND(Float, float)
+
+#undef ARRAY_TYPE_SET_FIND
+
 void AMessage::setObject(const char *name, const std::shared_ptr<void> &obj) {
     auto *item = allocateItem(name);
     item->mType = kTypeObject;
@@ -168,7 +229,7 @@ void AMessage::setObject(const char *name, const std::shared_ptr<void> &obj) {
 
 // FIXME: not sure if it's correct
 bool AMessage::findObject(const char *name, std::shared_ptr<void> *obj) const {
-    const auto *item = findItem(name, kTypeString);
+    const auto *item = findItem(name, kTypeObject);
     if (item != nullptr) {
         *obj = item->mObj;
         return true;
@@ -176,27 +237,28 @@ bool AMessage::findObject(const char *name, std::shared_ptr<void> *obj) const {
     return false;
 }
 
-void AMessage::deliver() {
-    std::shared_ptr<AHandler> handler = mHandler.lock();
-    if (handler == nullptr) {
-        LOG("W : failed to deliver message as target handler %d is gone", mTarget);
-        return;
-    }
-    handler->deliverMessage(shared_from_this());
-}
-
 status_t AMessage::post(int64_t delayUs) {
     std::shared_ptr<ALooper> looper = mLooper.lock();
     if (looper == nullptr) {
         LOG("W : failed to post message as target looper for handler %d is gone", mTarget);
         return NAME_NOT_FOUND;
     }
+    // the reference taken here is the one the queue keeps
     looper->post(shared_from_this(), delayUs);
     return OK;
 }
 
 status_t AMessage::postAndAwaitResponse(std::shared_ptr<AMessage> *response) {
-    std::shared_ptr<ALooper> looper = mLooper.lock();
+    // the handler may have migrated since this message was built, the looper it runs on now is
+    // the one which must not be waited for from its own thread
+    std::shared_ptr<ALooper> looper;
+    std::shared_ptr<AHandler> handler = mHandler.lock();
+    if (handler != nullptr) { looper = handler->looper(); }
+    if (looper != nullptr) {
+        mLooper = looper;
+    } else {
+        looper = mLooper.lock();
+    }
     if (looper == nullptr) {
         LOG("W : failed to post message as target looper for handler %d is gone", mTarget);
         return NAME_NOT_FOUND;
@@ -207,7 +269,12 @@ status_t AMessage::postAndAwaitResponse(std::shared_ptr<AMessage> *response) {
         LOG("E : failed to create reply token");
         return NO_MEMORY;
     }
-    setObject("reolyID", token);
+    setObject("replyID", token);
+
+    // waiting on our own looper thread would never return, deliver right away instead
+    if (looper->isCurrentThread()) {
+        return looper->deliverAndTakeResponse(shared_from_this(), token, response);
+    }
 
     looper->post(shared_from_this(), 0);
     return looper->awaitResponse(token, response);
@@ -241,6 +308,11 @@ bool AMessage::senderAwaitsResponse(std::shared_ptr<AReplyToken> *replyToken) {
 
 std::shared_ptr<AMessage> AMessage::dup() const {
     std::shared_ptr<AMessage> msg = std::make_shared<AMessage>(mWhat, mHandler.lock());
+    copyItemsTo(msg.get());
+    return msg;
+}
+
+void AMessage::copyItemsTo(AMessage *msg) const {
     msg->mNumItems = mNumItems;
 
     for (auto i = 0; i < mNumItems; ++i) {
@@ -250,9 +322,8 @@ std::shared_ptr<AMessage> AMessage::dup() const {
         to->setName(from->mName, from->mNameLength);
         to->mType = from->mType;
         to->u = from->u;
+        to->mObj = from->mObj;
     }
-
-    return msg;
 }
 
 std::string AMessage::debugString(int32_t indent) const {
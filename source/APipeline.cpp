@@ -0,0 +1,203 @@
+#define TAG "APipeline"
+
+#include <AHandler.h>
+#include <AMessage.h>
+#include <APipeline.h>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace diordna {
+
+APipeline::Stage::Stage(const char *name, const std::shared_ptr<AHandler> &handler,
+                        std::size_t capacity)
+    : mName(name),
+      mHandler(handler),
+      mLooper(std::make_shared<ALooper>()),
+      mInput(capacity),
+      mDrainScheduled(false),
+      mPrevious(nullptr),
+      mNext(nullptr),
+      mDrainPaused(false),
+      mProducerWaiting(false),
+      mBusyUs(0),
+      mProcessed(0),
+      mMaxOccupancy(0) {}
+
+APipeline::APipeline(std::size_t ringCapacity)
+    : mRingCapacity(ringCapacity > 0 ? ringCapacity : 1), mStartUs(0), mStarted(false) {}
+
+APipeline::~APipeline() {
+    // drain tasks still queued reference the stages, they must never run past this point
+    stop();
+}
+
+status_t APipeline::addStage(const char *name, const std::shared_ptr<AHandler> &handler) {
+    if (mStarted) { return INVALID_OPERATION; }
+    if (handler == nullptr || handler->id() != 0) { return BAD_VALUE; }
+
+    std::unique_ptr<Stage> stage(new Stage(name, handler, mRingCapacity));
+    stage->mLooper->setName(name);
+    stage->mLooper->registerHandler(handler);
+    if (!mStages.empty()) {
+        stage->mPrevious = mStages.back().get();
+        mStages.back()->mNext = stage.get();
+    }
+    mStages.push_back(std::move(stage));
+    return OK;
+}
+
+status_t APipeline::start() {
+    if (mStarted || mStages.empty()) { return INVALID_OPERATION; }
+    mStarted = true;
+    mStartUs = ALooper::GetNowUs();
+    for (const auto &stage : mStages) { stage->mLooper->start(); }
+    return OK;
+}
+
+status_t APipeline::stop() {
+    if (!mStarted) { return INVALID_OPERATION; }
+    mStarted = false;
+    for (const auto &stage : mStages) { stage->mLooper->stop(); }
+    return OK;
+}
+
+status_t APipeline::push(const std::shared_ptr<AMessage> &msg) {
+    if (mStages.empty()) { return NO_INIT; }
+    return enqueue(mStages.front().get(), msg);
+}
+
+status_t APipeline::forward(ALooper::handler_id from, const std::shared_ptr<AMessage> &msg) {
+    if (msg == nullptr) { return BAD_VALUE; }
+
+    for (std::size_t i = 0; i + 1 < mStages.size(); ++i) {
+        auto stage = mStages[i].get();
+        if (stage->mHandler->id() != from) { continue; }
+
+        // behind what is already waiting, to keep the order
+        if (stage->mOverflow.empty() && enqueue(stage->mNext, msg) == OK) { return OK; }
+        stage->mOverflow.push_back(msg);
+        if (stage->mOverflow.size() == 1) { waitForRoom(stage); }
+        return OK;
+    }
+    return NAME_NOT_FOUND;
+}
+
+std::shared_ptr<ALooper> APipeline::getLooper(std::size_t stage) const {
+    return stage < mStages.size() ? mStages[stage]->mLooper : nullptr;
+}
+
+std::vector<APipeline::StageStats> APipeline::getStats() const {
+    auto elapsedUs = ALooper::GetNowUs() - mStartUs;
+
+    std::vector<StageStats> stats;
+    for (const auto &stage : mStages) {
+        auto busyUs = stage->mBusyUs.load();
+        stats.push_back(StageStats{
+                stage->mName, elapsedUs > 0 && mStartUs > 0 ? (double)busyUs / elapsedUs : 0.0,
+                stage->mProcessed.load(), stage->mInput.size(), stage->mMaxOccupancy.load(),
+                stage->mInput.capacity()});
+    }
+    return stats;
+}
+
+status_t APipeline::enqueue(Stage *stage, const std::shared_ptr<AMessage> &msg) {
+    if (msg == nullptr) { return BAD_VALUE; }
+
+    std::shared_ptr<AMessage> item = msg;
+    if (!stage->mInput.push(std::move(item))) { return WOULD_BLOCK; }
+
+    // only the producer raises the high-water mark
+    auto occupancy = stage->mInput.size();
+    if (occupancy > stage->mMaxOccupancy.load(std::memory_order_relaxed)) {
+        stage->mMaxOccupancy.store(occupancy, std::memory_order_relaxed);
+    }
+
+    // pairs with the fence in drain(): either we see the consumer gave up, or it sees our push
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!stage->mDrainScheduled.exchange(true)) {
+        stage->mLooper->post([this, stage]() { drain(stage); });
+    }
+    return OK;
+}
+
+void APipeline::drain(Stage *stage) {
+    auto looper = stage->mLooper.get();
+    auto handler = stage->mHandler.get();
+    // the drain task itself
+    auto outer = looper->getCurrentDelivery();
+
+    std::shared_ptr<AMessage> msg;
+    std::size_t delivered = 0;
+    bool more = true;
+    while (more && delivered < kMaxDrainBatch) {
+        // hold the input back until the next stage has taken all that was forwarded
+        if (!stage->mOverflow.empty()) {
+            stage->mDrainPaused = true;
+            more = false;
+            break;
+        }
+        if (!stage->mInput.pop(&msg)) {
+            stage->mDrainScheduled.store(false);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            // a push racing with giving up finds the flag cleared, or is seen here
+            more = !stage->mInput.empty() && !stage->mDrainScheduled.exchange(true);
+            continue;
+        }
+
+        // reported as a delivery to the stage handler, as if it came through the queue
+        looper->beginDelivery(handler->id(), msg->what());
+        handler->deliverMessage(msg);
+        msg = nullptr;
+        stage->mBusyUs += looper->resumeDelivery(outer, handler);
+        ++stage->mProcessed;
+        ++delivered;
+    }
+    if (delivered > 0) { notifyProducer(stage); }
+
+    // let the other events of the looper through, and come back for the rest
+    if (more) { looper->post([this, stage]() { drain(stage); }); }
+}
+
+void APipeline::flush(Stage *stage) {
+    while (!stage->mOverflow.empty()) {
+        if (enqueue(stage->mNext, stage->mOverflow.front()) != OK) {
+            waitForRoom(stage);
+            return;
+        }
+        stage->mOverflow.pop_front();
+    }
+
+    // still holds mDrainScheduled
+    if (stage->mDrainPaused) {
+        stage->mDrainPaused = false;
+        drain(stage);
+    }
+}
+
+void APipeline::waitForRoom(Stage *stage) {
+    auto next = stage->mNext;
+    next->mProducerWaiting.store(true);
+    // pairs with the fence in notifyProducer(): either the consumer sees the flag, or we see the
+    // room it made
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (next->mInput.size() < next->mInput.capacity() && next->mProducerWaiting.exchange(false)) {
+        stage->mLooper->post([this, stage]() { flush(stage); });
+    }
+}
+
+void APipeline::notifyProducer(Stage *stage) {
+    auto previous = stage->mPrevious;
+    if (previous == nullptr) { return; }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (stage->mProducerWaiting.load(std::memory_order_relaxed) &&
+        stage->mProducerWaiting.exchange(false)) {
+        previous->mLooper->post([this, previous]() { flush(previous); });
+    }
+}
+
+}  // namespace diordna
\ No newline at end of file
@@ -0,0 +1,455 @@
+#define TAG "ARecorder"
+
+#include <AHandler.h>
+#include <ALooperRoster.h>
+#include <AMessage.h>
+#include <ARecorder.h>
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace diordna {
+
+extern ALooperRoster gLooperRoster;
+
+static const uint32_t kMagic = 0x43524c41;  // "ALRC"
+static const uint32_t kVersion = 1;
+
+enum {
+    FLAG_ASYNCHRONOUS = 1 << 0,
+};
+
+template <typename T>
+static void Append(std::vector<uint8_t> *buffer, const T &value) {
+    const auto *bytes = reinterpret_cast<const uint8_t *>(&value);
+    buffer->insert(buffer->end(), bytes, bytes + sizeof(T));
+}
+
+static void AppendBytes(std::vector<uint8_t> *buffer, const void *data, std::size_t size) {
+    const auto *bytes = static_cast<const uint8_t *>(data);
+    buffer->insert(buffer->end(), bytes, bytes + size);
+}
+
+template <typename T>
+static void AppendArray(std::vector<uint8_t> *buffer, const ASpan<T> &span) {
+    Append(buffer, static_cast<uint32_t>(span.size()));
+    AppendBytes(buffer, span.data(), span.size() * sizeof(T));
+}
+
+// bounds checked cursor over a record
+struct RecordReader {
+    RecordReader(const uint8_t *data, std::size_t size) : mData(data), mEnd(data + size) {}
+
+    template <typename T>
+    bool read(T *value) {
+        if (std::size_t(mEnd - mData) < sizeof(T)) { return false; }
+        std::memcpy(value, mData, sizeof(T));
+        mData += sizeof(T);
+        return true;
+    }
+
+    bool readBytes(std::size_t size, const uint8_t **bytes) {
+        if (std::size_t(mEnd - mData) < size) { return false; }
+        *bytes = mData;
+        mData += size;
+        return true;
+    }
+
+    template <typename T>
+    bool readArray(std::vector<T> *array) {
+        uint32_t count;
+        const uint8_t *bytes;
+        if (!read(&count) || !readBytes(std::size_t(count) * sizeof(T), &bytes)) { return false; }
+        array->resize(count);
+        if (count > 0) { std::memcpy(array->data(), bytes, std::size_t(count) * sizeof(T)); }
+        return true;
+    }
+
+private:
+    const uint8_t *mData;
+    const uint8_t *mEnd;
+};
+
+ARecorder::ARecorder() : mFile(nullptr), mRecorded(0) {}
+
+ARecorder::~ARecorder() { close(); }
+
+status_t ARecorder::open(const char *path) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    if (mFile != nullptr) { return INVALID_OPERATION; }
+
+    mFile = fopen(path, "wb");
+    if (mFile == nullptr) {
+        LOG("E : failed to open %s for recording", path);
+        return NAME_NOT_FOUND;
+    }
+    if (fwrite(&kMagic, sizeof(kMagic), 1, mFile) != 1 ||
+        fwrite(&kVersion, sizeof(kVersion), 1, mFile) != 1) {
+        LOG("E : failed to write the header of %s", path);
+        fclose(mFile);
+        mFile = nullptr;
+        return UNKNOWN_ERROR;
+    }
+    mRecorded = 0;
+    return OK;
+}
+
+status_t ARecorder::close() {
+    std::lock_guard<std::mutex> _lock(mLock);
+    if (mFile == nullptr) { return INVALID_OPERATION; }
+
+    auto err = fclose(mFile) == 0 ? OK : UNKNOWN_ERROR;
+    mFile = nullptr;
+    return err;
+}
+
+uint64_t ARecorder::recordedCount() {
+    std::lock_guard<std::mutex> _lock(mLock);
+    return mRecorded;
+}
+
+// static
+void ARecorder::Encode(int64_t timeUs, int64_t delayUs, ALooper::handler_id handlerId,
+                       const AMessage &msg, std::vector<uint8_t> *records) {
+    auto &buffer = *records;
+    auto recordOffset = buffer.size();
+    Append(&buffer, uint32_t(0));  // size, patched below
+    Append(&buffer, timeUs);
+    Append(&buffer, delayUs);
+    Append(&buffer, handlerId);
+    Append(&buffer, msg.what());
+    Append(&buffer, uint8_t(msg.isAsynchronous() ? FLAG_ASYNCHRONOUS : 0));
+    auto numItemsOffset = buffer.size();
+    Append(&buffer, uint16_t(0));  // patched below
+
+    uint16_t numItems = 0;
+    for (std::size_t i = 0; i < msg.countEntries(); ++i) {
+        AMessage::Type type;
+        const char *name = msg.getEntryNameAt(i, &type);
+        if (type == AMessage::kTypeObject || type == AMessage::kTypeNone) { continue; }
+
+        auto nameLength = uint16_t(std::strlen(name));
+        Append(&buffer, uint8_t(type));
+        Append(&buffer, nameLength);
+        AppendBytes(&buffer, name, nameLength);
+
+        switch (type) {
+            case AMessage::kTypeInt32: {
+                int32_t value = 0;
+                msg.findInt32(name, &value);
+                Append(&buffer, value);
+                break;
+            }
+            case AMessage::kTypeInt64: {
+                int64_t value = 0;
+                msg.findInt64(name, &value);
+                Append(&buffer, value);
+                break;
+            }
+            case AMessage::kTypeSize: {
+                std::size_t value = 0;
+                msg.findSize(name, &value);
+                Append(&buffer, uint64_t(value));
+                break;
+            }
+            case AMessage::kTypeFloat: {
+                float value = 0;
+                msg.findFloat(name, &value);
+                Append(&buffer, value);
+                break;
+            }
+            case AMessage::kTypeDouble: {
+                double value = 0;
+                msg.findDouble(name, &value);
+                Append(&buffer, value);
+                break;
+            }
+            case AMessage::kTypeString: {
+                std::string value;
+                msg.findString(name, &value);
+                Append(&buffer, uint32_t(value.size()));
+                AppendBytes(&buffer, value.data(), value.size());
+                break;
+            }
+            case AMessage::kTypeInt32Array: {
+                ASpan<int32_t> span;
+                msg.findInt32Array(name, &span);
+                AppendArray(&buffer, span);
+                break;
+            }
+            case AMessage::kTypeInt64Array: {
+                ASpan<int64_t> span;
+                msg.findInt64Array(name, &span);
+                AppendArray(&buffer, span);
+                break;
+            }
+            case AMessage::kTypeFloatArray: {
+                ASpan<float> span;
+                msg.findFloatArray(name, &span);
+                AppendArray(&buffer, span);
+                break;
+            }
+            default:
+                break;
+        }
+        ++numItems;
+    }
+
+    auto size = uint32_t(buffer.size() - recordOffset - sizeof(uint32_t));
+    std::memcpy(buffer.data() + recordOffset, &size, sizeof(size));
+    std::memcpy(buffer.data() + numItemsOffset, &numItems, sizeof(numItems));
+}
+
+void ARecorder::write(const std::vector<uint8_t> &records, std::size_t count) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    if (mFile == nullptr || records.empty()) { return; }
+
+    if (fwrite(records.data(), records.size(), 1, mFile) != 1) {
+        LOG("E : failed to write a record, recording stopped");
+        fclose(mFile);
+        mFile = nullptr;
+        return;
+    }
+    mRecorded += count;
+}
+
+AReplayer::AReplayer() : mCancelled(false), mFile(nullptr) {}
+
+AReplayer::~AReplayer() { close(); }
+
+status_t AReplayer::open(const char *path) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    if (mFile != nullptr) { return INVALID_OPERATION; }
+
+    mFile = fopen(path, "rb");
+    if (mFile == nullptr) {
+        LOG("E : failed to open %s for replay", path);
+        return NAME_NOT_FOUND;
+    }
+
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    if (fread(&magic, sizeof(magic), 1, mFile) != 1 ||
+        fread(&version, sizeof(version), 1, mFile) != 1 || magic != kMagic ||
+        version != kVersion) {
+        LOG("E : %s is not a recording this version can replay", path);
+        fclose(mFile);
+        mFile = nullptr;
+        return BAD_TYPE;
+    }
+    return OK;
+}
+
+void AReplayer::close() {
+    std::lock_guard<std::mutex> _lock(mLock);
+    if (mFile == nullptr) { return; }
+    fclose(mFile);
+    mFile = nullptr;
+}
+
+void AReplayer::mapHandler(ALooper::handler_id recordedId,
+                           const std::shared_ptr<AHandler> &handler) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    mHandlerMap[recordedId] = handler;
+}
+
+void AReplayer::cancel() {
+    std::lock_guard<std::mutex> _lock(mLock);
+    mCancelled = true;
+    mCancelCondition.notify_all();
+}
+
+std::shared_ptr<AHandler> AReplayer::findHandler(ALooper::handler_id recordedId) {
+    {
+        std::lock_guard<std::mutex> _lock(mLock);
+        auto it = mHandlerMap.find(recordedId);
+        if (it != mHandlerMap.end()) { return it->second.lock(); }
+    }
+    return gLooperRoster.findHandler(recordedId);
+}
+
+status_t AReplayer::replay(Pace pace, std::size_t *posted, std::size_t *skipped) {
+    {
+        std::lock_guard<std::mutex> _lock(mLock);
+        if (mFile == nullptr) { return NO_INIT; }
+        mCancelled = false;
+    }
+    // the replay runs on the calling thread only, the file needs no locking past this point
+    if (fseek(mFile, sizeof(kMagic) + sizeof(kVersion), SEEK_SET) != 0) { return UNKNOWN_ERROR; }
+
+    std::size_t postedCount = 0;
+    std::size_t skippedCount = 0;
+    // resolved once per handler id, nullptr when it cannot be found
+    KeyedVector<ALooper::handler_id, std::shared_ptr<AHandler>> handlers;
+
+    int64_t startUs = ALooper::GetNowUs();
+    int64_t firstTimeUs = 0;
+    status_t err = OK;
+
+    for (;;) {
+        int64_t timeUs;
+        int64_t delayUs;
+        ALooper::handler_id handlerId;
+        std::shared_ptr<AMessage> msg;
+        err = readRecord(&timeUs, &delayUs, &handlerId, &msg);
+        if (err == NOT_ENOUGH_DATA) {
+            err = OK;
+            break;
+        }
+        if (err != OK) { break; }
+
+        if (pace == PACE_ORIGINAL) {
+            if (postedCount + skippedCount == 0) { firstTimeUs = timeUs; }
+            auto dueUs = startUs + (timeUs - firstTimeUs);
+
+            std::unique_lock<std::mutex> _lock(mLock);
+            auto waitUs = dueUs - ALooper::GetNowUs();
+            if (waitUs > 0) {
+                mCancelCondition.wait_for(_lock, std::chrono::microseconds(waitUs),
+                                          [this]() { return mCancelled; });
+            }
+        } else {
+            delayUs = 0;
+        }
+
+        {
+            std::lock_guard<std::mutex> _lock(mLock);
+            if (mCancelled) {
+                err = INVALID_OPERATION;
+                break;
+            }
+        }
+
+        auto it = handlers.find(handlerId);
+        if (it == handlers.end()) {
+            it = handlers.emplace(handlerId, findHandler(handlerId)).first;
+            if (it->second == nullptr) {
+                LOG("W : no handler for recorded handler %d, skipping its messages", handlerId);
+            }
+        }
+        if (it->second == nullptr) {
+            ++skippedCount;
+            continue;
+        }
+
+        msg->setTarget(it->second);
+        if (msg->post(delayUs) == OK) {
+            ++postedCount;
+        } else {
+            ++skippedCount;
+        }
+    }
+
+    if (posted != nullptr) { *posted = postedCount; }
+    if (skipped != nullptr) { *skipped = skippedCount; }
+    return err;
+}
+
+status_t AReplayer::readRecord(int64_t *timeUs, int64_t *delayUs, ALooper::handler_id *handlerId,
+                               std::shared_ptr<AMessage> *msg) {
+    uint32_t size;
+    if (fread(&size, sizeof(size), 1, mFile) != 1) { return NOT_ENOUGH_DATA; }
+    mBuffer.resize(size);
+    if (size > 0 && fread(mBuffer.data(), size, 1, mFile) != 1) {
+        LOG("E : truncated record");
+        return BAD_VALUE;
+    }
+
+    RecordReader reader(mBuffer.data(), mBuffer.size());
+    uint32_t what;
+    uint8_t flags;
+    uint16_t numItems;
+    if (!reader.read(timeUs) || !reader.read(delayUs) || !reader.read(handlerId) ||
+        !reader.read(&what) || !reader.read(&flags) || !reader.read(&numItems)) {
+        LOG("E : corrupted record header");
+        return BAD_VALUE;
+    }
+
+    *msg = std::make_shared<AMessage>();
+    (*msg)->setWhat(what);
+    (*msg)->setAsynchronous((flags & FLAG_ASYNCHRONOUS) != 0);
+
+    for (uint16_t i = 0; i < numItems; ++i) {
+        uint8_t type;
+        uint16_t nameLength;
+        const uint8_t *nameBytes;
+        if (!reader.read(&type) || !reader.read(&nameLength) ||
+            !reader.readBytes(nameLength, &nameBytes)) {
+            LOG("E : corrupted item");
+            return BAD_VALUE;
+        }
+        std::string name(reinterpret_cast<const char *>(nameBytes), nameLength);
+
+        bool ok = false;
+        switch (type) {
+            case AMessage::kTypeInt32: {
+                int32_t value;
+                if ((ok = reader.read(&value))) { (*msg)->setInt32(name.c_str(), value); }
+                break;
+            }
+            case AMessage::kTypeInt64: {
+                int64_t value;
+                if ((ok = reader.read(&value))) { (*msg)->setInt64(name.c_str(), value); }
+                break;
+            }
+            case AMessage::kTypeSize: {
+                uint64_t value;
+                if ((ok = reader.read(&value))) { (*msg)->setSize(name.c_str(), value); }
+                break;
+            }
+            case AMessage::kTypeFloat: {
+                float value;
+                if ((ok = reader.read(&value))) { (*msg)->setFloat(name.c_str(), value); }
+                break;
+            }
+            case AMessage::kTypeDouble: {
+                double value;
+                if ((ok = reader.read(&value))) { (*msg)->setDouble(name.c_str(), value); }
+                break;
+            }
+            case AMessage::kTypeString: {
+                uint32_t length;
+                const uint8_t *bytes;
+                if ((ok = reader.read(&length) && reader.readBytes(length, &bytes))) {
+                    (*msg)->setString(name.c_str(),
+                                      std::string(reinterpret_cast<const char *>(bytes), length));
+                }
+                break;
+            }
+            case AMessage::kTypeInt32Array: {
+                std::vector<int32_t> array;
+                if ((ok = reader.readArray(&array))) {
+                    (*msg)->setInt32Array(name.c_str(), array.data(), array.size());
+                }
+                break;
+            }
+            case AMessage::kTypeInt64Array: {
+                std::vector<int64_t> array;
+                if ((ok = reader.readArray(&array))) {
+                    (*msg)->setInt64Array(name.c_str(), array.data(), array.size());
+                }
+                break;
+            }
+            case AMessage::kTypeFloatArray: {
+                std::vector<float> array;
+                if ((ok = reader.readArray(&array))) {
+                    (*msg)->setFloatArray(name.c_str(), array.data(), array.size());
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        if (!ok) {
+            LOG("E : corrupted or unknown item \"%s\" of type %d", name.c_str(), type);
+            return BAD_VALUE;
+        }
+    }
+    return OK;
+}
+
+}  // namespace diordna
\ No newline at end of file
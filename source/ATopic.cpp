@@ -0,0 +1,89 @@
+#define TAG "ATopic"
+
+#include <AHandler.h>
+#include <AMessage.h>
+#include <ATopic.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace diordna {
+
+ATopic::ATopic() : mGroups(std::make_shared<std::vector<Group>>()) {}
+
+status_t ATopic::subscribe(const std::shared_ptr<AHandler> &handler) {
+    if (handler == nullptr) { return BAD_VALUE; }
+    if (handler->looper() == nullptr) {
+        LOG("W : handler %d must be registered to a looper before subscribing", handler->id());
+        return NO_INIT;
+    }
+
+    std::lock_guard<std::mutex> _lock(mLock);
+    for (const auto &it : mSubscribers) {
+        if (it.lock() == handler) { return ALREADY_EXISTS; }
+    }
+    mSubscribers.push_back(handler);
+    rebuildGroupsLocked();
+    return OK;
+}
+
+status_t ATopic::unsubscribe(const std::shared_ptr<AHandler> &handler) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    for (auto it = mSubscribers.begin(); it != mSubscribers.end(); ++it) {
+        if (it->lock() == handler) {
+            mSubscribers.erase(it);
+            rebuildGroupsLocked();
+            return OK;
+        }
+    }
+    return NAME_NOT_FOUND;
+}
+
+status_t ATopic::publish(const std::shared_ptr<AMessage> &msg, int64_t delayUs) {
+    if (msg == nullptr) { return BAD_VALUE; }
+
+    std::shared_ptr<const std::vector<Group>> groups;
+    {
+        std::lock_guard<std::mutex> _lock(mLock);
+        groups = mGroups;
+    }
+
+    for (const auto &group : *groups) {
+        std::shared_ptr<ALooper> looper = group.mLooper.lock();
+        if (looper == nullptr) { continue; }
+        looper->postBroadcast(msg, delayUs, group.mHandlers);
+    }
+    return OK;
+}
+
+void ATopic::rebuildGroupsLocked() {
+    std::vector<std::shared_ptr<ALooper>> loopers;
+    std::vector<std::shared_ptr<ALooper::HandlerList>> handlers;
+
+    for (auto it = mSubscribers.begin(); it != mSubscribers.end();) {
+        std::shared_ptr<AHandler> handler = it->lock();
+        std::shared_ptr<ALooper> looper = handler != nullptr ? handler->looper() : nullptr;
+        if (looper == nullptr) {
+            it = mSubscribers.erase(it);
+            continue;
+        }
+
+        std::size_t i = 0;
+        while (i < loopers.size() && loopers[i] != looper) { ++i; }
+        if (i == loopers.size()) {
+            loopers.push_back(looper);
+            handlers.push_back(std::make_shared<ALooper::HandlerList>());
+        }
+        handlers[i]->push_back(handler);
+        ++it;
+    }
+
+    auto groups = std::make_shared<std::vector<Group>>();
+    for (std::size_t i = 0; i < loopers.size(); ++i) {
+        groups->push_back(Group{loopers[i], handlers[i]});
+    }
+    mGroups = groups;
+}
+
+}  // namespace diordna
\ No newline at end of file
@@ -0,0 +1,114 @@
+#define TAG "AWatchdog"
+
+#include <AWatchdog.h>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace diordna {
+
+AWatchdog::AWatchdog(int64_t checkIntervalUs)
+    : mCheckIntervalUs(checkIntervalUs > 0 ? checkIntervalUs : 1), mRunning(false) {}
+
+AWatchdog::~AWatchdog() { stop(); }
+
+status_t AWatchdog::watch(const std::shared_ptr<ALooper> &looper, int64_t budgetUs) {
+    if (looper == nullptr || budgetUs <= 0) { return BAD_VALUE; }
+
+    std::lock_guard<std::mutex> _lock(mLock);
+    for (auto &it : mWatched) {
+        if (it.mLooper.lock() == looper) {
+            it.mBudgetUs = budgetUs;
+            return OK;
+        }
+    }
+    mWatched.push_back(Watched{looper, budgetUs, 0});
+    return OK;
+}
+
+status_t AWatchdog::unwatch(const std::shared_ptr<ALooper> &looper) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    for (auto it = mWatched.begin(); it != mWatched.end(); ++it) {
+        if (it->mLooper.lock() == looper) {
+            mWatched.erase(it);
+            return OK;
+        }
+    }
+    return NAME_NOT_FOUND;
+}
+
+void AWatchdog::setCallback(const Callback &callback) {
+    std::lock_guard<std::mutex> _lock(mLock);
+    mCallback = callback;
+}
+
+status_t AWatchdog::start() {
+    std::lock_guard<std::mutex> _lock(mLock);
+    if (mRunning) { return INVALID_OPERATION; }
+    mRunning = true;
+    mThread = std::thread([this]() { threadLoop(); });
+    return OK;
+}
+
+status_t AWatchdog::stop() {
+    {
+        std::lock_guard<std::mutex> _lock(mLock);
+        if (!mRunning) { return INVALID_OPERATION; }
+        mRunning = false;
+        mCondition.notify_all();
+    }
+    mThread.join();
+    return OK;
+}
+
+void AWatchdog::threadLoop() {
+    std::unique_lock<std::mutex> _lock(mLock);
+    while (mRunning) {
+        mCondition.wait_for(_lock, std::chrono::microseconds(mCheckIntervalUs));
+        if (!mRunning) { break; }
+
+        std::vector<Stall> stalls;
+        checkLocked(&stalls);
+        if (stalls.empty()) { continue; }
+
+        // report without the lock, the callback may well (un)watch loopers
+        auto callback = mCallback;
+        _lock.unlock();
+        for (const auto &stall : stalls) {
+            if (callback) {
+                callback(stall);
+            } else {
+                LOG("W : looper \"%s\" stalled for %lld us delivering what %u to handler %d",
+                    stall.mLooperName.c_str(), (long long)stall.mElapsedUs, stall.mWhat,
+                    stall.mHandlerId);
+            }
+        }
+        _lock.lock();
+    }
+}
+
+void AWatchdog::checkLocked(std::vector<Stall> *stalls) {
+    auto nowUs = ALooper::GetNowUs();
+    for (auto it = mWatched.begin(); it != mWatched.end();) {
+        std::shared_ptr<ALooper> looper = it->mLooper.lock();
+        if (looper == nullptr) {
+            it = mWatched.erase(it);
+            continue;
+        }
+
+        auto delivery = looper->getCurrentDelivery();
+        auto elapsedUs = nowUs - delivery.mStartUs;
+        if (delivery.mStartUs != 0 && elapsedUs > it->mBudgetUs &&
+            delivery.mSeq != it->mReportedSeq) {
+            it->mReportedSeq = delivery.mSeq;
+            stalls->push_back(
+                Stall{looper->getName(), delivery.mHandlerId, delivery.mWhat, elapsedUs});
+        }
+        ++it;
+    }
+}
+
+}  // namespace diordna
\ No newline at end of file